@@ -0,0 +1,19 @@
+#
+# slgpy, SLG logs for Python
+#   python3 setup.py build_ext --inplace
+# The module includes slgtopngmt.c built without its command line.
+# Seekable zstd input: add ("HAVE_ZSTD", None) to define_macros and
+# "zstd" to libraries.
+#
+from setuptools import setup, Extension
+
+setup(name="slgpy",
+      version="1.0",
+      description="SLG echo grams and page headers as buffers",
+      ext_modules=[Extension("slgpy",
+                             sources=["slgpy.c"],
+                             depends=["slgtopngmt.c", "palettedata.h"],
+                             define_macros=[],
+                             extra_compile_args=["-ffloat-store"],
+                             library_dirs=["/usr/local/lib"],
+                             libraries=["png14", "z", "m", "pthread"])])
@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# Render one log as N local shard processes and merge them.
+#   ./shard.sh N prefix [slgtopngmt options]
+# The options are passed to every shard, -p is added.
+# With -d each shard writes data.i and the merge combines them.
+
+N=$1
+PREFIX=$2
+shift 2
+SLGTOPNG=${SLGTOPNG:-./slgtopngmt2}
+
+DATA=""
+for ARG in "$@"; do
+     if [ "${LAST}" = "-d" ]; then DATA="${ARG}"; fi
+     LAST="${ARG}"
+done
+
+echo "**************************************" 
+THETIME=$(date +%H:%M:%S)
+THEDATE=$(date +%m-%d-%y)
+echo "TIME: ${THEDATE} ${THETIME}" 
+
+i=0
+while [ $i -lt $N ]; do
+     ${SLGTOPNG} "$@" -p ${PREFIX} --shard $i/$N > ${PREFIX}_shard_$i.log 2>&1 &
+     i=$((i+1))
+done
+wait
+
+if [ -n "${DATA}" ]; then
+     ${SLGTOPNG} --merge -p ${PREFIX} -d ${DATA}
+else
+     ${SLGTOPNG} --merge -p ${PREFIX}
+fi
+
+exit 0
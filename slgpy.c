@@ -0,0 +1,549 @@
+/*
+ * slgpy - SLG logs for Python
+ *
+ * A thin module over the slgtopngmt core, built from the same source with
+ * SLG_LIBRARY defined so the command line is left out. A Log scans the
+ * log once and hands out its echo grams and page header columns through
+ * the buffer protocol, numpy.asarray() takes them without a copy:
+ *
+ *   log = slgpy.Log("lg.slg")
+ *   echo = numpy.asarray(log.echograms)        # pages x 2546 uint8
+ *   depth = numpy.asarray(log.depth)           # float32 per page
+ *   img = numpy.asarray(log.render(0, 500))    # 1280 x 500 x 3 uint8
+ *
+ * Plain logs are memory mapped, the echo gram matrix is a strided view of
+ * the mapping when the pages follow each other with one header size, and
+ * gathered once otherwise. An echo gram row is the echo bytes inside its
+ * page, as the bottom search reads them, 2546 or 2526 with the longer
+ * headers. Gathered rows are as long as the longest and zero filled
+ * after shorter pages. The log is followed by a page of zeros for
+ * render(), whose sections read a full echo gram past the last page.
+ * Compressed logs and archives are decompressed
+ * into memory when opened. Header columns are strided views of the page
+ * index. render() rasterizes a page range as the section images are, on
+ * threads with the GIL released. A log that can't be opened raises
+ * OSError, a damaged log or colormap ValueError.
+ *
+ * Build: python3 setup.py build_ext --inplace
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#define SLG_LIBRARY
+#include "slgtopngmt.c"
+
+/* a log, scanned when opened */
+typedef struct {
+     PyObject_HEAD
+     char *data;                      // the log, mapped or decompressed
+     size_t size;
+     size_t map_size;                 // mapping with its zero tail, 0 when decompressed
+
+     processed_page_data *pages;      // valid pages, damaged ranges left out
+     int count;
+     char *echo;                      // gathered echo grams, NULL when a view of data
+     char *echo_base;                 // first echo gram
+     Py_ssize_t echo_stride;
+     int echo_len;                    // echo gram row, the longest in page echo
+     float mintemp;
+     float maxtemp;
+} LogObject;
+
+/* read only array over memory kept alive by owner */
+typedef struct {
+     PyObject_HEAD
+     PyObject *owner;
+     char *buf;
+     char *format;
+     Py_ssize_t itemsize;
+     int ndim;
+     Py_ssize_t shape[3];
+     Py_ssize_t strides[3];
+} ViewObject;
+
+/* render() worker, a share of the range's pages */
+typedef struct {
+     LogObject *log;
+     colormap_lut *colormap;
+     rgbcolor *img;
+     int first;                       // first page of the share
+     int count;
+     int stride;                      // image width
+     int column;                      // image column of the share's first page
+} render_share;
+
+static PyTypeObject ViewType;
+static PyTypeObject LogType;
+
+static int View_getbuffer(ViewObject *self, Py_buffer *view, int flags){
+
+     Py_ssize_t len = self->itemsize;
+     Py_ssize_t step = self->itemsize;
+     int contiguous = 1;
+     int d;
+
+     if(flags&PyBUF_WRITABLE){
+          PyErr_SetString(PyExc_BufferError, "slgpy views are read only");
+          return -1;
+     }
+     for(d=self->ndim-1;d>=0;--d){
+          if(self->strides[d]!=step)contiguous = 0;
+          step *= self->shape[d];
+          len *= self->shape[d];
+     }
+     if(!contiguous&&(flags&PyBUF_STRIDES)!=PyBUF_STRIDES){
+          PyErr_SetString(PyExc_BufferError, "slgpy view is strided");
+          return -1;
+     }
+
+     view->obj = (PyObject*) self;
+     Py_INCREF(self);
+     view->buf = self->buf;
+     view->len = len;
+     view->readonly = 1;
+     view->itemsize = self->itemsize;
+     view->format = (flags&PyBUF_FORMAT) ? self->format : NULL;
+     view->ndim = self->ndim;
+     view->shape = (flags&PyBUF_ND) ? self->shape : NULL;
+     view->strides = (flags&PyBUF_STRIDES)==PyBUF_STRIDES ? self->strides : NULL;
+     view->suboffsets = NULL;
+     view->internal = NULL;
+     return 0;
+}
+
+static void View_dealloc(ViewObject *self){
+     Py_XDECREF(self->owner);
+     Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static PyBufferProcs View_as_buffer = {
+     (getbufferproc) View_getbuffer,
+     NULL
+};
+
+static PyTypeObject ViewType = {
+     PyVarObject_HEAD_INIT(NULL, 0)
+     .tp_name = "slgpy.View",
+     .tp_basicsize = sizeof(ViewObject),
+     .tp_dealloc = (destructor) View_dealloc,
+     .tp_as_buffer = &View_as_buffer,
+     .tp_flags = Py_TPFLAGS_DEFAULT,
+     .tp_doc = "Read only array over a log's memory",
+};
+
+/* memoryview of ndim items of format, the view holds a reference to owner */
+static PyObject* view_new(PyObject *owner, char *buf, char *format, Py_ssize_t itemsize, int ndim,
+                          Py_ssize_t *shape, Py_ssize_t *strides){
+
+     ViewObject *view;
+     PyObject *mv;
+     int d;
+
+     view = PyObject_New(ViewObject, &ViewType);
+     if(!view)return NULL;
+     Py_INCREF(owner);
+     view->owner = owner;
+     view->buf = buf;
+     view->format = format;
+     view->itemsize = itemsize;
+     view->ndim = ndim;
+     for(d=0;d<ndim;++d){
+          view->shape[d] = shape[d];
+          view->strides[d] = strides[d];
+     }
+     mv = PyMemoryView_FromObject((PyObject*) view);
+     Py_DECREF(view);
+     return mv;
+}
+
+/* views need a scanned log, __init__ may not have run or have failed */
+static int log_ready(LogObject *self){
+
+     if(self->pages&&self->count)
+          return 1;
+     PyErr_SetString(PyExc_ValueError, "Log is not open");
+     return 0;
+}
+
+/* the field at offset of every page in the index */
+static PyObject* column_view(LogObject *self, size_t offset, char *format, Py_ssize_t itemsize){
+
+     Py_ssize_t shape = self->count;
+     Py_ssize_t stride = sizeof(processed_page_data);
+
+     if(!log_ready(self))return NULL;
+     return view_new((PyObject*) self, (char*) self->pages+offset, format, itemsize, 1, &shape, &stride);
+}
+
+/* scan the log in memory for its valid pages, as the command line scan
+ * does. Runs without the GIL */
+static char* log_scan(LogObject *self){
+
+     page_scan scan;
+     page_data page;
+     processed_page_data *grown;
+     off_t pos = FILE_HEADER_SIZE, prev = -1, found;
+     int cap = 0;
+     int i, have_temp = 0;
+
+     /* the whole log is the scan window, nothing is read */
+     memset(&scan, 0, sizeof(page_scan));
+     scan.file_size = self->size;
+     scan.data = self->data;
+     scan.start = 0;
+     scan.len = self->size;
+     scan.last_flags = -1;
+
+     for(;;){
+          found = scan_page(&scan, pos, prev<0 ? pos : prev+1, &page);
+          if(found<0)break;
+          if(self->count==cap){
+               cap = cap ? cap*2 : 4096;
+               grown = realloc(self->pages, sizeof(processed_page_data)*cap);
+               if(!grown)return "out of memory for the page index";
+               self->pages = grown;
+          }
+          page_record(&self->pages[self->count], &page, self->count, found);
+          self->count++;
+          prev = found;
+          pos = found+SONAR_SIZE;
+     }
+     if(!self->count)return "no valid sonar pages";
+
+     /* palettes over the whole log's temperature range */
+     for(i=0;i<self->count;++i){
+          float t = self->pages[i].temprf;
+          if(t<=0)continue;
+          if(!have_temp||t<self->mintemp)self->mintemp = t;
+          if(!have_temp||t>self->maxtemp)self->maxtemp = t;
+          have_temp = 1;
+     }
+     page_palettes(self->pages, self->count, self->mintemp, self->maxtemp);
+
+     /* echo grams are a strided view when every page is a page size on
+      * from the one before, with the same header size */
+     int uniform = 1;
+     size_t lead = page_echo((raw_sonar_page*) (self->data+self->pages[0].offset))-(self->data+self->pages[0].offset);
+     for(i=1;i<self->count&&uniform;++i){
+          char *p = self->data+self->pages[i].offset;
+          if(self->pages[i].offset!=self->pages[i-1].offset+SONAR_SIZE||
+             page_echo((raw_sonar_page*) p)-p!=(ptrdiff_t)lead)
+               uniform = 0;
+     }
+     if(uniform){
+          self->echo_len = page_echo_len((raw_sonar_page*) (self->data+self->pages[0].offset));
+          self->echo_base = self->data+self->pages[0].offset+lead;
+          self->echo_stride = SONAR_SIZE;
+          return NULL;
+     }
+
+     /* gathered, shorter pages zero filled to the longest */
+     self->echo_len = 0;
+     for(i=0;i<self->count;++i){
+          int len = page_echo_len((raw_sonar_page*) (self->data+self->pages[i].offset));
+          if(len>self->echo_len)self->echo_len = len;
+     }
+     self->echo = calloc(self->count, self->echo_len);
+     if(!self->echo)return "out of memory for the echo grams";
+     for(i=0;i<self->count;++i){
+          raw_sonar_page *page = (raw_sonar_page*) (self->data+self->pages[i].offset);
+          memcpy(self->echo+(size_t)i*self->echo_len, page_echo(page), page_echo_len(page));
+     }
+     self->echo_base = self->echo;
+     self->echo_stride = self->echo_len;
+     return NULL;
+}
+
+/* drop the log's memory, a failed open leaves the Log empty */
+static void log_release(LogObject *self){
+     if(self->map_size)munmap(self->data, self->map_size);
+     else free(self->data);
+     free(self->pages);
+     free(self->echo);
+     self->data = NULL;
+     self->size = self->map_size = 0;
+     self->pages = NULL;
+     self->count = 0;
+     self->echo = self->echo_base = NULL;
+     self->echo_len = 0;
+     self->mintemp = self->maxtemp = 0;
+}
+
+static int Log_init(LogObject *self, PyObject *args, PyObject *kwds){
+
+     static char *kwlist[] = {"path", NULL};
+     PyObject *path_obj;
+     char *path, *error = NULL;
+     char message[ERROR_SIZE];
+     slg_source source;
+     int open_errno = 0;
+
+     if(!PyArg_ParseTupleAndKeywords(args, kwds, "O&", kwlist, PyUnicode_FSConverter, &path_obj))
+          return -1;
+     if(self->data){
+          Py_DECREF(path_obj);
+          PyErr_SetString(PyExc_RuntimeError, "Log is already open");
+          return -1;
+     }
+     path = PyBytes_AsString(path_obj);
+
+     Py_BEGIN_ALLOW_THREADS
+     /* a log that can't be opened raises OSError, a damaged index
+      * ValueError */
+     if(source_open(&source, path, message)){
+          if(source.fd<0)open_errno = errno;
+          error = message;
+     }
+     self->size = source.size;
+     if(!error&&source.type==SOURCE_PLAIN){
+          /* the log mapped over anonymous zero pages */
+          long os_page = sysconf(_SC_PAGESIZE);
+          self->map_size = (self->size+SONAR_SIZE+os_page-1)/os_page*os_page;
+          self->data = mmap(NULL, self->map_size, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+          if(self->data==MAP_FAILED||
+             (self->size&&mmap(self->data, self->size, PROT_READ, MAP_SHARED|MAP_FIXED, source.fd, 0)==MAP_FAILED)){
+               if(self->data!=MAP_FAILED)munmap(self->data, self->map_size);
+               self->data = NULL;
+               self->map_size = 0;
+               error = "log could not be mapped";
+          }
+     }else if(!error)
+     {
+          /* compressed frames decompress in parallel */
+          self->data = calloc(self->size+SONAR_SIZE, 1);
+          if(!self->data)
+               error = "out of memory for the log";
+          else if(source_pread_parallel(&source, self->data, self->size, 0, THREADS)!=(ssize_t)self->size)
+               error = "log could not be read";
+     }
+     if(!error&&self->size<FILE_HEADER_SIZE+SONAR_SIZE)
+          error = "insufficient sonar data";
+     if(!error&&detect_format((unsigned char*) self->data))
+          error = "SL2/SL3 log, convert it with slgtopngmt --archive first";
+     if(!error)
+          error = log_scan(self);
+     source_close(&source);
+     if(source.fd>=0)close(source.fd);
+     if(error)log_release(self);
+     Py_END_ALLOW_THREADS
+
+     if(open_errno){
+          errno = open_errno;
+          PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+     }else if(error)
+          PyErr_SetString(PyExc_ValueError, error);
+     Py_DECREF(path_obj);
+     return error ? -1 : 0;
+}
+
+static void Log_dealloc(LogObject *self){
+     log_release(self);
+     Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static Py_ssize_t Log_length(LogObject *self){
+     return self->count;
+}
+
+static PyObject* Log_echograms(LogObject *self, void *closure){
+
+     Py_ssize_t shape[2] = {self->count, self->echo_len};
+     Py_ssize_t strides[2] = {self->echo_stride, 1};
+
+     if(!log_ready(self))return NULL;
+     return view_new((PyObject*) self, self->echo_base, "B", 1, 2, shape, strides);
+}
+
+static PyObject* Log_flags(LogObject *self, void *closure){
+     return column_view(self, offsetof(processed_page_data, flags), "i", sizeof(int));
+}
+
+static PyObject* Log_depth_limit(LogObject *self, void *closure){
+     return column_view(self, offsetof(processed_page_data, depth_limit_bottom), "f", sizeof(float));
+}
+
+static PyObject* Log_depth(LogObject *self, void *closure){
+     return column_view(self, offsetof(processed_page_data, depth_hard), "f", sizeof(float));
+}
+
+static PyObject* Log_temperature(LogObject *self, void *closure){
+     return column_view(self, offsetof(processed_page_data, temprf), "f", sizeof(float));
+}
+
+static PyObject* Log_temperature_c(LogObject *self, void *closure){
+     return column_view(self, offsetof(processed_page_data, temprc), "f", sizeof(float));
+}
+
+static PyObject* Log_lat(LogObject *self, void *closure){
+     return column_view(self, offsetof(processed_page_data, lat), "d", sizeof(double));
+}
+
+static PyObject* Log_lon(LogObject *self, void *closure){
+     return column_view(self, offsetof(processed_page_data, lon), "d", sizeof(double));
+}
+
+static PyObject* Log_offset(LogObject *self, void *closure){
+     return column_view(self, offsetof(processed_page_data, offset), sizeof(off_t)==8 ? "q" : "i", sizeof(off_t));
+}
+
+static PyObject* Log_palette(LogObject *self, void *closure){
+     return column_view(self, offsetof(processed_page_data, palette), "i", sizeof(int));
+}
+
+static PyObject* Log_zero_copy(LogObject *self, void *closure){
+     return PyBool_FromLong(self->map_size&&!self->echo);
+}
+
+static PyObject* Log_temp_range(LogObject *self, void *closure){
+     return Py_BuildValue("(dd)", self->mintemp, self->maxtemp);
+}
+
+/* rasterize a share of the pages into its image columns */
+static void* render_pages(void *ptr_data){
+
+     render_share *share = (render_share*) ptr_data;
+     LogObject *log = share->log;
+     thread_section_data td;
+     column_info column;
+     int i;
+
+     memset(&td, 0, sizeof(thread_section_data));
+     td.colormap = share->colormap;
+     td.height = ECHO_GRAM_SIZE/REDUCTION_FACTOR;
+
+     for(i=0;i<share->count;++i){
+          processed_page_data *pd = &log->pages[share->first+i];
+          rasterize_page(&td, (raw_sonar_page*) (log->data+pd->offset), share->img+share->column+i,
+                         share->stride, pd->palette, &column, NULL);
+     }
+     return NULL;
+}
+
+static PyObject* Log_render(LogObject *self, PyObject *args, PyObject *kwds){
+
+     static char *kwlist[] = {"first", "count", "threads", "colormap", "tempmap", "brightness", NULL};
+     int first = 0, count = -1, threads = THREADS, brightness = BRIGHTNESS_COMPENSATION;
+     char *echo_map = "grey", *temp_map = "temp";
+     int height = ECHO_GRAM_SIZE/REDUCTION_FACTOR;
+     colormap_lut colormap;
+     render_share share[MAX_THREADS];
+     pthread_t helpers[MAX_THREADS];
+     int started[MAX_THREADS];
+     PyObject *img, *mv, *shaped;
+     char message[ERROR_SIZE];
+     int i;
+
+     if(!PyArg_ParseTupleAndKeywords(args, kwds, "|iiissi", kwlist, &first, &count, &threads,
+                                     &echo_map, &temp_map, &brightness))
+          return NULL;
+     if(!log_ready(self))return NULL;
+     if(count<0)count = self->count-first;
+     if(first<0||count<1||first+count>self->count){
+          PyErr_SetString(PyExc_IndexError, "page range outside the log");
+          return NULL;
+     }
+     if(threads<1)threads = 1;
+     if(threads>MAX_THREADS)threads = MAX_THREADS;
+     if(threads>count)threads = count;
+
+     if(build_colormap(&colormap, echo_map, temp_map, brightness, message)){
+          PyErr_SetString(PyExc_ValueError, message);
+          return NULL;
+     }
+
+     img = PyByteArray_FromStringAndSize(NULL, (Py_ssize_t)height*count*sizeof(rgbcolor));
+     if(!img)return NULL;
+
+     Py_BEGIN_ALLOW_THREADS
+     for(i=0;i<threads;++i){
+          share[i].log = self;
+          share[i].colormap = &colormap;
+          share[i].img = (rgbcolor*) PyByteArray_AS_STRING(img);
+          share[i].column = (long long)count*i/threads;
+          share[i].first = first+share[i].column;
+          share[i].count = (long long)count*(i+1)/threads-share[i].column;
+          share[i].stride = count;
+          started[i] = i>0&&pthread_create(&helpers[i], NULL, render_pages, &share[i])==0;
+          if(i>0&&!started[i])render_pages(&share[i]);
+     }
+     render_pages(&share[0]);
+     for(i=1;i<threads;++i){
+          if(started[i])pthread_join(helpers[i], NULL);
+     }
+     Py_END_ALLOW_THREADS
+
+     /* rows of the image, pixels in PNG byte order */
+     mv = PyMemoryView_FromObject(img);
+     Py_DECREF(img);
+     if(!mv)return NULL;
+     shaped = PyObject_CallMethod(mv, "cast", "s(iii)", "B", height, count, (int)sizeof(rgbcolor));
+     Py_DECREF(mv);
+     return shaped;
+}
+
+static PyGetSetDef Log_getset[] = {
+     {"echograms", (getter) Log_echograms, NULL, "Echo grams, pages x in page echo bytes uint8", NULL},
+     {"flags", (getter) Log_flags, NULL, "Page flags, int32", NULL},
+     {"depth_limit", (getter) Log_depth_limit, NULL, "Depth at the bottom of the echo gram, float32", NULL},
+     {"depth", (getter) Log_depth, NULL, "Depth, float32", NULL},
+     {"temperature", (getter) Log_temperature, NULL, "Water temperature F, -100 without a reading, float32", NULL},
+     {"temperature_c", (getter) Log_temperature_c, NULL, "Water temperature C, -100 without a reading, float32", NULL},
+     {"lat", (getter) Log_lat, NULL, "Latitude, 0 without a fix, float64", NULL},
+     {"lon", (getter) Log_lon, NULL, "Longitude, 0 without a fix, float64", NULL},
+     {"offset", (getter) Log_offset, NULL, "Offset of the page in the log, int64", NULL},
+     {"palette", (getter) Log_palette, NULL, "Temperature palette index, int32", NULL},
+     {"zero_copy", (getter) Log_zero_copy, NULL, "Echo grams are a view of the mapped log", NULL},
+     {"temp_range", (getter) Log_temp_range, NULL, "Temperature range F of the palettes", NULL},
+     {NULL}
+};
+
+static PyMethodDef Log_methods[] = {
+     {"render", (PyCFunction) Log_render, METH_VARARGS|METH_KEYWORDS,
+      "render(first=0, count=-1, threads=4, colormap='grey', tempmap='temp', brightness=-245)\n"
+      "Rasterize pages as a section image, 1280 x count x 3 uint8"},
+     {NULL}
+};
+
+static PySequenceMethods Log_as_sequence = {
+     (lenfunc) Log_length,
+};
+
+static PyTypeObject LogType = {
+     PyVarObject_HEAD_INIT(NULL, 0)
+     .tp_name = "slgpy.Log",
+     .tp_basicsize = sizeof(LogObject),
+     .tp_dealloc = (destructor) Log_dealloc,
+     .tp_as_sequence = &Log_as_sequence,
+     .tp_flags = Py_TPFLAGS_DEFAULT,
+     .tp_doc = "Log(path)\nAn SLG log, plain, bgzip, seekable zstd or archive, scanned for its valid pages",
+     .tp_getset = Log_getset,
+     .tp_methods = Log_methods,
+     .tp_init = (initproc) Log_init,
+     .tp_new = PyType_GenericNew,
+};
+
+static struct PyModuleDef slgpy_module = {
+     PyModuleDef_HEAD_INIT,
+     "slgpy",
+     "SLG echo grams and page headers as buffers",
+     -1,
+     NULL
+};
+
+PyMODINIT_FUNC PyInit_slgpy(void){
+
+     PyObject *m;
+
+     if(PyType_Ready(&ViewType)<0||PyType_Ready(&LogType)<0)
+          return NULL;
+     m = PyModule_Create(&slgpy_module);
+     if(!m)return NULL;
+     Py_INCREF(&LogType);
+     if(PyModule_AddObject(m, "Log", (PyObject*) &LogType)<0){
+          Py_DECREF(&LogType);
+          Py_DECREF(m);
+          return NULL;
+     }
+     return m;
+}
@@ -10,17 +10,43 @@
  *
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#define _FILE_OFFSET_BITS 64
+
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stddef.h>
+#include <errno.h>
 #include <math.h>
 
 #include <pthread.h>
+#include <sched.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#if defined(__linux__)&&defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #define PNG_DEBUG 3
 #include "/usr/local/include/libpng14/png.h"
@@ -39,6 +65,125 @@
 #define PAGE_SIZE (SONAR_SIZE)
 #define PAGE_HEADER_SIZE 50
 #define ECHO_GRAM_SIZE 2560
+#define REDUCTION_FACTOR 2
+#define BRIGHTNESS_COMPENSATION -245
+#define TEMP_STRIP_ROWS 30
+
+/* bottom tracking */
+#define BOTTOM_SKIP 64                // surface clutter samples ignored
+#define BOTTOM_EDGE 8                 // samples across a rising edge
+#define BOTTOM_MIN_EDGE 32            // weakest edge taken as bottom
+#define BOTTOM_SMOOTH 5               // pages in the median window
+
+/* auto levels, one histogram per depth band of the image */
+#define AUTOLEVEL_BANDS 8
+
+/* echo filters, a median of nine through a min/max network */
+#define SORT_U8(a, b) { t = a<b ? a : b; b = a<b ? b : a; a = t; }
+#define SORT_SSE2(a, b) { t = _mm_min_epu8(a, b); b = _mm_max_epu8(a, b); a = t; }
+#define MEDIAN9(p, SORT) { \
+     SORT(p[1], p[2]); SORT(p[4], p[5]); SORT(p[7], p[8]); \
+     SORT(p[0], p[1]); SORT(p[3], p[4]); SORT(p[6], p[7]); \
+     SORT(p[1], p[2]); SORT(p[4], p[5]); SORT(p[7], p[8]); \
+     SORT(p[0], p[3]); SORT(p[5], p[8]); SORT(p[4], p[7]); \
+     SORT(p[3], p[6]); SORT(p[1], p[4]); SORT(p[2], p[5]); \
+     SORT(p[4], p[7]); SORT(p[4], p[2]); SORT(p[6], p[4]); \
+     SORT(p[4], p[2]); }
+
+/* worker threads */
+#define THREADS 4
+#define MAX_THREADS 64
+#define SPLIT_MIN_PAGES 64            // fewest pages worth a column block
+
+/* worker placement */
+#define AFFINITY_NONE 0
+#define AFFINITY_CORE 1
+#define AFFINITY_NODE 2
+#define MAX_NODES 64
+
+/* asynchronous I/O */
+#define IO_ALIGN 4096                 // O_DIRECT offset and length alignment
+#define IO_CHUNK_SIZE (256*1024)      // section read size per request
+#define IO_QUEUE_DEPTH 8              // section reads in flight
+#define IO_RING_ENTRIES 16
+#define IO_TAG_WRITE 0x8000000000000000ULL
+
+/* encoder state of an image, zlib's deflate state at the default window
+ * and memory level is about 256K, the rest is slack for libpng's structs */
+#define ENCODER_BYTES (400*1024)
+
+/* colormaps */
+#define COLORMAP_SIZE 256
+
+/* message buffer of the setup calls that report errors instead of
+ * ending the process, for the Python module */
+#define ERROR_SIZE 256
+
+/* depth grid resampling tables kept per worker, by depth_limit_bottom */
+#define RESAMPLE_TABLES 64
+
+/* render cache, bump when a change alters rendered images */
+#define CACHE_VERSION 2
+
+/* outputs rendered from one read of each section, with the command line's */
+#define MAX_TARGETS 8
+
+/* page summary tree, each level pools SUMMARY_FANOUT nodes of the one below */
+#define SUMMARY_FANOUT 16
+#define SUMMARY_MAX_LEVELS 16
+#define SUMMARY_FIELDS 3
+#define SUMMARY_TEMP 0                // temperature F, pages with a reading
+#define SUMMARY_DEPTH 1               // depth
+#define SUMMARY_LIMIT 2               // depth limit
+#define SUMMARY_MAGIC "SLGS"
+#define SUMMARY_VERSION 1
+
+/* GPS grid index, about GPS_CELL_FIXES fixes a cell */
+#define GPS_CELL_FIXES 4
+#define GPS_GRID_MAX 1024
+#define GPS_MAGIC "SLGG"
+#define GPS_VERSION 1
+
+/* overview pooling, pages per overview column */
+#define POOL_MEAN 0
+#define POOL_MAX 1
+#define POOL_KEY_STRIP 256            // max pooling keys, bottom line over echo over
+#define POOL_KEY_ECHO 512             // temp strip over rows past the page
+#define POOL_KEY_LINE 768
+
+/* huge page size for MAP_HUGETLB arenas */
+#define HUGE_PAGE_SIZE (2*1024*1024)
+
+/* log formats, from the first word of the file header */
+#define SLG_FORMAT_SLG 1
+#define SLG_FORMAT_SL2 2
+#define SLG_FORMAT_SL3 3
+
+/* input sources, plain or seekable compressed */
+#define SOURCE_PLAIN 0
+#define SOURCE_BGZF 1                 // blocked gzip, bgzip
+#define SOURCE_ZSTD 2                 // seekable zstd
+#define SOURCE_ARCHIVE 3              // chunked archive written by --archive
+#define ZSTD_SEEKABLE_MAGIC 0x8F92EAB1
+
+/* chunked archive, pages delta coded against the page before and
+ * deflated ARCHIVE_CHUNK_PAGES at a time */
+#define ARCHIVE_MAGIC "SLGA"
+#define ARCHIVE_VERSION 2
+#define ARCHIVE_CHUNK_PAGES 256
+#define ARCHIVE_LEVEL 6
+
+/* SLG page validation */
+#define PAGE_MAX_DEPTH 3000.0         // deepest plausible depth limit
+#define PAGE_MIN_TEMPR -10.0          // plausible water temperature, C
+#define PAGE_MAX_TEMPR 60.0
+
+/* streamed input */
+#define STREAM_BUFFER (1024*1024)     // read ahead of the page being taken
+
+/* SL2/SL3 block scanning */
+#define MAX_CHANNELS 16
+#define BLOCK_SCAN_WINDOW (1024*1024)
 
 /* structures */
 typedef struct {
@@ -59,6 +204,7 @@ typedef struct {
   png_byte color_type;
   png_byte bit_depth;
   png_bytep *row_pointers;
+  int level;                          // zlib level, -1 for libpng's default
 
 } img_data_info;
 
@@ -92,6 +238,10 @@ typedef struct {
      double lat;
      double lon;
      int ordinal;
+     off_t offset;                    // file offset of page or block
+     int size;                        // bytes to read at offset
+     float bottom_depth;              // tracked bottom, -1 when not found
+     int palette;                     // temperature palette index
 } processed_page_data;
 
 typedef struct {
@@ -107,47 +257,584 @@ typedef struct {
      char buff[SONAR_SIZE];
 } raw_sonar_page;  
 
+/* compressed frame, decompressed independently of the others */
+typedef struct {
+     off_t coffset;                   // offset in the compressed file
+     unsigned csize;
+     off_t uoffset;                   // offset in the log
+     unsigned usize;
+} source_frame;
+
+/* SLG input. Compressed logs are read through their frame index, so
+ * any page range decompresses only the frames it touches */
+typedef struct {
+     int fd;
+     int type;
+     off_t size;                      // log size, uncompressed
+     source_frame *frames;
+     int frame_count;
+     processed_page_data *headers;    // archive page headers, NULL for logs
+     int page_count;                  // pages in the archive
+} slg_source;
+
+/* frames of one read decompressed by a helper thread */
+typedef struct {
+     slg_source *src;
+     char *buf;
+     size_t len;
+     off_t offset;
+     int first;                       // frames first, first+step, ...
+     int last;
+     int step;
+     int failed;
+} source_read;
+
+/* SLG header scan through a window of the file */
+typedef struct {
+     slg_source *src;
+     off_t file_size;
+     char *data;
+     off_t start;                     // file offset of data
+     size_t len;                      // bytes in data
+     int last_flags;                  // flags of the last valid page
+     int resyncs;
+     off_t skipped;                   // bytes skipped by resyncs
+} page_scan;
+
+/* SLG pages read strictly in order from a pipe */
+typedef struct {
+     int fd;
+     char *data;
+     size_t pos;                      // first unread byte of data
+     size_t len;                      // bytes in data
+     long prev;                       // last page in data, -1 before the first
+     off_t offset;                    // stream offset of data
+     int eof;
+     page_scan scan;                  // last flags and resync counts
+} stream_input;
+
+/* SL2/SL3 block header layout, byte offsets into the block header */
+typedef struct {
+     int format;
+     char *name;
+     int header_size;
+     int off_block_size;
+     int off_channel;
+     int off_packet_size;
+     int off_lower_limit;
+     int off_depth;
+     int off_tempr;
+     int off_lon;
+     int off_lat;
+} block_layout;
+
+/* SL2/SL3 block index entry */
+typedef struct {
+     off_t offset;                    // file offset of block header
+     int block_size;                  // total block size
+     int packet_size;                 // echo bytes after the header
+     int channel;
+     float lower_limit;
+     float depth;
+     float tempr;
+     int lon;
+     int lat;
+} sonar_block;
+
+typedef struct {
+     sonar_block *blocks;
+     int count;
+     int size;
+} block_index;
+
+/* block boundary discovery over one file region */
+typedef struct {
+     slg_source *src;
+     block_layout *layout;
+     off_t start;
+     off_t stop;
+     off_t file_size;
+     off_t end;                       // offset the walk stopped at
+     block_index index;
+} block_scan_region;
+
+/* io_uring submission and completion rings, fd -1 when not in use */
+typedef struct {
+     int fd;
+     unsigned entries;
+     unsigned inflight;
+     unsigned pending;
+     unsigned *sq_head;
+     unsigned *sq_tail;
+     unsigned *sq_mask;
+     unsigned *sq_array;
+     unsigned *cq_head;
+     unsigned *cq_tail;
+     unsigned *cq_mask;
+#ifdef HAVE_IO_URING
+     struct io_uring_sqe *sqes;
+     struct io_uring_cqe *cqes;
+#endif
+     void *sq_ptr;
+     void *cq_ptr;
+     size_t sq_size;
+     size_t cq_size;
+     size_t sqes_size;
+} io_ring;
+
+/* growable memory target for encoded images */
+typedef struct {
+     char *data;
+     size_t size;
+     size_t cap;
+} png_buffer;
+
+/* Per worker I/O state, reused across images like the arena */
+typedef struct {
+     io_ring ring;
+     int direct;                      // O_DIRECT section reads
+     int write_fd;                    // output in flight, -1 when idle
+     png_buffer out;                  // encoded image being written
+} worker_io;
+
+/* NUMA nodes and their cpus */
+typedef struct {
+     int nodes;
+     int cpus[MAX_NODES];
+     cpu_set_t cpuset[MAX_NODES];
+} cpu_topology;
+
+/* per column values kept for passes over the finished image */
+typedef struct {
+     int rows;                        // echo gram rows written
+     int strip;                       // first temp strip row
+     int palette;                     // temperature palette index
+     int step;                        // echo gram samples per row
+     int first;                       // echo gram row of the image's top row
+     float grid;                      // image rows per echo gram sample on the depth grid, 0 when not
+     float grid_offset;               // image row of sample 0 on the depth grid
+     int bottom_raw;                  // detected bottom sample, -1 when none
+     int bottom;                      // bottom after smoothing across pages
+} column_info;
+
+/* echo gram sampling of a page onto the depth grid. Row y reads
+ * between samples index[y] and index[y]+1, weight/256 of the second */
+typedef struct {
+     float depth;                     // depth_limit_bottom of the table, 0 when empty
+     int target;                      // render target of the table
+     int rows;                        // grid rows the page reaches
+     short *index;
+     unsigned char *weight;
+} resample_table;
+
+/* Per worker arena, sized once for the largest section and reused for every image */
+typedef struct {
+     void *base;
+     size_t size;
+     int huge;                        // backed by MAP_HUGETLB
+     void *pSonarInput;               // raw pages
+     void *pNewEchoData;              // image data
+     png_bytep *pImg_row_ptrs;        // image row pointers
+     column_info *columns;            // per column image values
+     resample_table *resample;        // depth grid tables, allocated on first use
+     unsigned char *filter;           // filter planes, allocated on first use
+     int pages;                       // pages the arena holds
+     int height;                      // image rows the arena holds a page
+} worker_arena;
+
+/* Section read, queued in chunks ahead of the rasterizer */
+typedef struct {
+     worker_io *io;
+     int fd;
+     int direct;                      // fd is opened O_DIRECT
+     int buffered_fd;                 // never O_DIRECT, for retries at any offset
+     char *buf;                       // aligned read target
+     char *pages;                     // first page inside buf
+     off_t offset;                    // file offset of buf
+     size_t total;                    // bytes wanted from buf
+     size_t ready;                    // bytes complete from the start of buf
+     size_t queued;                   // bytes queued from the start of buf
+     int chunks;
+     char *done;                      // per chunk completion
+} section_reader;
+
+/* filters over each image's echo values before colors are applied */
+typedef struct {
+     float tvg_spread;                // gain spread*log10(depth)+2*alpha*depth in echo counts
+     float tvg_alpha;
+     int median;                      // 3x3 median despeckle
+     int smooth;                      // [1 2 1] passes along the pages
+} filter_chain;
+
+/* color lookups built once per run and shared read only by the workers */
+typedef struct {
+     rgbcolor echo[COLORMAP_SIZE];    // echo value, brightness applied
+     rgbcolor levels[COLORMAP_SIZE];  // leveled echo value
+     rgbcolor temp[COLORMAP_SIZE];    // temperature palette
+} colormap_lut;
+
+/* one image written row by row, sections add their rows in order */
+typedef struct {
+     png_structp png_ptr;
+     png_infop info_ptr;
+     FILE *fp;
+     int next;                        // section whose rows go next
+     png_bytep fill;                  // row for pages a section could not read
+     pthread_mutex_t mutex;
+     pthread_cond_t turn;
+} png_stream;
+
+/* images written to a descriptor in image order instead of to files */
+typedef struct {
+     int fd;
+     int framed;                      // length-prefixed images
+     int next;                        // image whose turn it is
+     pthread_mutex_t mutex;
+     pthread_cond_t turn;
+} output_sink;
+
+/* whole run overview, each column pools a block of pages */
+typedef struct {
+     int width;
+     int height;
+     int pages;                       // pages in the run
+     int pool;                        // POOL_MEAN or POOL_MAX
+     unsigned int *acc;               // per column rgb sums, or max pooling keys
+     unsigned int *count;             // pages pooled per column
+} overview_image;
+
+/* an output of the run. Target 0 is the command line's, --target adds
+ * more that share each section's read */
+typedef struct {
+     char *prefix;                    // images are <prefix>_output_<n>.png
+     char *colormap_name;
+     char *tempmap_name;
+     colormap_lut colormap;
+     float roi_top;                   // depth band, roi_bottom 0 when off
+     float roi_bottom;
+     float depth_scale;               // depth per image row, 0 keeps the echo gram scale
+     int height;                      // image rows per page
+     int scale;                       // image reduction, 1 full size
+     int level;                       // zlib level, -1 for libpng's default
+     int overview_width;              // pool into an overview, 0 for section images
+     overview_image overview;
+     unsigned int run_histogram[256];
+} render_target;
+
+/* min, max and sum of a page field over a range */
+typedef struct {
+     float min;
+     float max;
+     double sum;
+     int count;                       // pages with a value
+} summary_stat;
+
+/* a page position */
+typedef struct {
+     int page;
+     double lat;
+     double lon;
+} gps_fix;
+
+/* uniform grid over the bounds of the run's positions, the fixes of a
+ * cell are fix[cell_start[cell]] to fix[cell_start[cell+1]-1] */
+typedef struct {
+     int pages;                       // pages of the run
+     int fixes;                       // pages with a position
+     int dim;                         // cells a side
+     double min_lat;
+     double max_lat;
+     double min_lon;
+     double max_lon;
+     int *cell_start;
+     gps_fix *fix;
+     int *order;                      // fix pages in page order
+} gps_index;
+
+/* a bounding box, or a polygon with its bounding box */
+typedef struct {
+     double min_lat;
+     double max_lat;
+     double min_lon;
+     double max_lon;
+     int points;                      // polygon corners, 0 for a box
+     double *lat;
+     double *lon;
+} gps_shape;
+
+/* summaries of the run's page fields. Level 0 holds the pages, a node
+ * of level l covers SUMMARY_FANOUT^l pages */
+typedef struct {
+     int pages;
+     int levels;
+     int level_size[SUMMARY_MAX_LEVELS];
+     summary_stat *level[SUMMARY_MAX_LEVELS];   // SUMMARY_FIELDS stats a node
+     summary_stat *data;
+} summary_tree;
+
 /* Thread Specific Data struct*/
 typedef struct {
      int total_pages_to_process;      // total pages to process
+     int image_pages;                 // pages of the run's images, the last may have fewer
      int sonar_page_count;            // total page count in file 
      int sonar_page_offset;           // page offset into file to start processing  
-     int sonar_data_offset;           // offset into file in bytes
+     off_t sonar_data_offset;         // offset into file in bytes
      int sonar_size;                  // page sonar size
      int sonar_offset;                // 2800*$sonar_size;
      int total_pages_processed;
      int verbose;
      int thread;
+     int image;                       // image number across all shards
      int temprscan;
      float mintempr;
      float maxtempr;
      processed_page_data *page_data;
+     block_layout *layout;            // NULL for classic SLG pages
+     worker_arena *arena;
+     worker_io *io;
+     int slgfd;
+     slg_source *source;              // log reads, plain or compressed
+     int directfd;                    // O_DIRECT descriptor, -1 when not used
+     int brightness;
+     int autolevels;
+     float level_low;                 // auto level percentiles
+     float level_high;
+     unsigned int *run_histogram;     // whole run histogram, merged lock free
+     int bottom;                      // track and draw the bottom
+     int pages_before;                // run pages before the section, bottoms smooth across
+     int pages_after;                 // run pages after the section
+     int bottom_edges[2*(BOTTOM_SMOOTH/2)]; // raw bottoms of the pages either side, -1 for none
+     filter_chain *filters;           // NULL when the echo is not filtered
+     int height;                      // image rows per page
+     float roi_top;                   // depth band, roi_bottom 0 when off
+     float roi_bottom;
+     float depth_scale;               // depth per image row, 0 keeps the echo gram scale
+     int rows;                        // pages are image rows
+     png_stream *stream;              // shared image in rows mode
+     overview_image *overview;        // pool into the overview, NULL when not
+     int raw_echo;                    // image keeps echo values for max pooling
+     colormap_lut *colormap;
+     output_sink *sink;               // NULL writes image files
+     char *cache_dir;                 // render cache, NULL when not used
+     int *cache_hits;
+     render_target *targets;          // outputs rendered from the section's pages
+     int target_cnt;
+     int target;                      // the target being rendered
+     int scale;                       // image reduction of the target
+     int level;                       // zlib level of the target
+     int streamed;                    // pages are in the arena, read from a stream
+     int split;                       // column blocks the image is rasterized in, 0 or 1 for one
+     int slot;                        // the worker's slot, helper k stands in for slot+k*slot_step
+     int slot_step;                   // workers of the round, the slots past them are idle
+     worker_arena *slot_arenas;       // every slot's arena, helpers take an idle slot's tables
+     cpu_set_t *slot_cpus;            // every slot's cpus under --affinity, NULL otherwise
      FILE* slgfile;
      char* inputfile;
      char* file_prepend;
 } thread_section_data;
 
+/* archive chunk compressed by a helper thread */
+typedef struct {
+     thread_section_data td;          // the chunk's pages and their source
+     int count;
+     char *raw;
+     unsigned char *out;
+     unsigned long out_len;
+} archive_chunk;
+
+/* column block of a section's pages rasterized by a helper thread */
+typedef struct {
+     thread_section_data td;          // the worker's, with its own depth grid tables
+     worker_arena arena;
+     raw_sonar_page *pages;           // the section's first page
+     int first;                       // pages first to last-1
+     int last;
+     rgbcolor *pImgdata;
+     int line_step;
+     int line_stride;
+     unsigned int (*histogram)[256];  // the block's auto level counts
+} raster_block;
+
 // thread mutex
 pthread_mutex_t td_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 
 void *section_process_thread(void*);
+void *raster_block_thread(void *ptr_data);
+int rasterize_blocks(thread_section_data *td, section_reader *reader, void *pSonarInput, int count,
+                     int line_step, int line_stride, unsigned int histogram[][256]);
+void render_section(thread_section_data *td, section_reader *reader, void *pSonarInput, int total_pages_read);
+void target_apply(thread_section_data *td, render_target *target, int index);
+void target_parse(render_target *target, render_target *base, char *spec);
+int target_height(render_target *target, processed_page_data *pages, int count, int verbose);
+void downsample_image(rgbcolor *img, int stride, int *width, int *height, int n);
 void write_png_file(char* file_name, void *data, img_data_info img_data);
+void write_png(FILE *fp, png_buffer *buf, img_data_info img_data);
 void abort_(const char * s, ...);
+int fail_(char *error, const char * s, ...);
 double latconvert( long lat_in);
 double lonconvert( long lon_in);
+block_layout* detect_format(unsigned char *header);
+int page_valid(page_data *page);
+unsigned int rd_u16(unsigned char *p);
+unsigned int rd_u32(unsigned char *p);
+off_t scan_page(page_scan *ps, off_t pos, off_t from, page_data *page);
+size_t stream_fill(stream_input *si, size_t need);
+off_t stream_next_page(stream_input *si, void *dest, page_data *page, int ordinal);
+void page_record(processed_page_data *rec, page_data *page, int ordinal, off_t offset);
+void write_page_row(FILE *fp, processed_page_data *pd, int page, int bottom);
+void page_palettes(processed_page_data *pages, int count, float mintemp, float maxtemp);
+int stream_run(thread_section_data *base, stream_input *si, int thread_cnt, int pages_per_image, int first_page,
+               int page_limit, int hugepages, int iouring, float temp_low, float temp_high, FILE *csv);
+int build_block_index(slg_source *src, block_layout *layout, int regions, block_index *index);
+int source_open(slg_source *src, char *filename, char *error);
+void source_close(slg_source *src);
+int source_index_archive(slg_source *src, char *filename, off_t file_size, char *error);
+void archive_delta(char *pages, int count);
+void archive_undelta(char *pages, int count);
+void archive_write(char *file_name, slg_source *src, block_layout *layout, char *log_header,
+                   processed_page_data *pages, int count, int first_page, int threads);
+ssize_t source_pread(slg_source *src, void *buf, size_t len, off_t offset);
+ssize_t source_pread_parallel(slg_source *src, void *buf, size_t len, off_t offset, int threads);
+int read_section_pages(thread_section_data *td, void *pSonarInput, int count);
+void arena_create(worker_arena *arena, int pages, int height, int hugepages);
+size_t arena_bytes(int pages, int height, size_t *offsets);
+size_t section_bytes(int pages, int height, int encoded, int resample, int filters);
+long long parse_size(char *str);
+void arena_destroy(worker_arena *arena);
+void read_topology(cpu_topology *topo);
+int ring_init(io_ring *ring, unsigned entries);
+void ring_exit(io_ring *ring);
+void io_drain_writes(worker_io *io);
+int reader_start(section_reader *rd, thread_section_data *td, void *buf, int count);
+size_t reader_wait(section_reader *rd, size_t upto);
+void reader_finish(section_reader *rd);
+void write_png_async(worker_io *io, char* file_name, img_data_info img_data);
+int histogram_level(unsigned int *histogram, float percent);
+int detect_bottom(unsigned char *echo, int len);
+void smooth_bottom(column_info *columns, int count, int *edges);
+void bottom_edges(thread_section_data *td, int count);
+float page_factor(float dbreak);
+int roi_rows(float dbreak, float top, float bottom, int *first);
+resample_table* resample_lookup(thread_section_data *td, float dbreak);
+void autolevel_lut(unsigned int *histogram, float low, float high, unsigned char *lut);
+void worker_cpuset(cpu_topology *topo, int mode, int slot, int slots, cpu_set_t *set);
+void rasterize_page(thread_section_data *td, raw_sonar_page *pPageRaw, rgbcolor *pImgdata, int stride,
+                    int palette_index, column_info *column, unsigned int histogram[][256]);
+void autolevel_luts(unsigned int histogram[][256], float low, float high, unsigned int *run_histogram, unsigned char lut[][256]);
+void apply_levels(unsigned char lut[][256], rgbcolor *pImgdata, int stride, column_info *column, colormap_lut *colormap);
+void draw_bottom(rgbcolor *pImgdata, int stride, column_info *column);
+void filter_image(thread_section_data *td, rgbcolor *pImgdata, int line_step, int line_stride,
+                  int width, unsigned int histogram[][256]);
+void filter_gain(thread_section_data *td, column_info *column, float dbreak, short *gain, int height);
+void filter_add(unsigned char *p, int n, int gain);
+unsigned char median_pixel(unsigned char *r0, unsigned char *r1, unsigned char *r2, int x, int width);
+void filter_median(unsigned char *src, unsigned char *dst, int width, int height);
+void filter_smooth(unsigned char *src, unsigned char *dst, int width, int height);
+void png_stream_open(png_stream *stream, char *file_name, output_sink *sink, int width, int height);
+void sink_write_image(output_sink *sink, int seq, int image, png_buffer *buf);
+void sink_skip(output_sink *sink, int seq);
+unsigned long long hash64(unsigned long long h, void *data, size_t len);
+unsigned long long section_key(thread_section_data *td, void *pSonarInput, int count);
+int copy_file(char *from, char *to);
+char* page_echo(raw_sonar_page *pPageRaw);
+int page_echo_len(raw_sonar_page *pPageRaw);
+int cache_fetch(thread_section_data *td, char *cache_path, char *filename);
+void cache_store(thread_section_data *td, char *cache_path, char *filename);
+void png_stream_rows(png_stream *stream, int section, png_bytep *rows, int count, int total);
+void png_stream_close(png_stream *stream);
+void overview_create(overview_image *ov, int width, int height, int pages, int pool);
+void overview_add(overview_image *ov, int first_page, rgbcolor *pImgdata, int line_step, int stride, int count,
+                  column_info *columns);
+void overview_write(overview_image *ov, char *file_name, output_sink *sink, colormap_lut *colormap, int leveled);
+void summary_alloc(summary_tree *tree, int pages);
+void summary_build(summary_tree *tree, processed_page_data *pages, int count);
+void summary_query(summary_tree *tree, int first, int last, summary_stat *stats);
+void summary_write(summary_tree *tree, char *file_name);
+void summary_read(summary_tree *tree, char *file_name);
+void summary_free(summary_tree *tree);
+void gps_index_build(gps_index *idx, processed_page_data *pages, int count);
+void gps_index_write(gps_index *idx, char *file_name);
+void gps_index_read(gps_index *idx, char *file_name);
+void gps_index_free(gps_index *idx);
+void gps_shape_parse(gps_shape *shape, char *box, char *polygon);
+int gps_inside(gps_shape *shape, double lat, double lon);
+int gps_index_query(gps_index *idx, gps_shape *shape, int **runs);
+int create_palette(rgbcolor palette[], int palette_colors);
+int load_colormap(char *name, rgbcolor map[], char *error);
+int build_colormap(colormap_lut *colormap, char *echo_map, char *temp_map, int brightness, char *error);
+void write_manifest(char *prepend, int shard, int shards, char *input, char *datafile,
+                    processed_page_data *pages, int page_base, int image_base, int images, int image_pages);
+void merge_shards(char *prepend, char *datafile);
+
+/* echo gram samples per image row, by depth range in steps of 10 */
+float reduction_factors[]={20.0, 16.0, 8.0, 5.7, 4.0, 4.15, 3.15, (16/7), 2.0, 2.0};
 
+/* SLG page flags, the high word of the page flags */
+int slg_page_flags[] = {0x2c11, 0x6d14, 0x6d04};
 
+/* known SL2/SL3 layouts */
+block_layout block_layouts[] = {
+     /* format          name   hdr  size chan pack lower depth tempr lon  lat */
+     {SLG_FORMAT_SL2,  "SL2", 144,  28,  32,  34,  44,   64,  104, 108, 112},
+     {SLG_FORMAT_SL3,  "SL3", 168,   8,  12,  44,  24,   48,   84,  88,  92}
+};
+
+
+/* the library build, for the Python module, leaves out the command line */
+#ifndef SLG_LIBRARY
 int main(int argc, char **argv){
      
-     int i, j, k, x, y;
+     int i, k, x, y;
      /* process command line options */
      int clOffset = 0;
      int clVerbose = 0;
      int clTemprscan = 0;
      int clPageCount = 5000;
+     int clPageCountSet = 0;
      int clMaxImgPages = 500;
      int clOutputDataFile = 0;
+     int clChannel = 0;
+     int clHugePages = 0;
+     int clStats = 0;
+     int clThreads = THREADS;
+     int clAffinity = AFFINITY_NONE;
+     int clIoUring = 0;
+     int clDirect = 0;
+     int clBrightness = BRIGHTNESS_COMPENSATION;
+     int clAutoLevels = 0;
+     float clLevelLow = 1;
+     float clLevelHigh = 99;
+     int clBottom = 0;
+     filter_chain clFilters = {0, 0, 0, 0};
+     filter_chain *filters = NULL;
+     int clRows = 0;
+     int clOverview = 0;
+     int clPool = POOL_MEAN;
+     char *clColormap = "grey";
+     char *clTempmap = "temp";
+     int clShard = 0;
+     int clShards = 0;
+     int clMerge = 0;
+     int clSinkFd = -1;
+     int clFramed = 0;
+     char *clCache = NULL;
+     float clRoiTop = 0;
+     float clRoiBottom = 0;
+     float clDepthScale = 0;
+     long long clMemLimit = 0;
+     char *clSummary = NULL;
+     char *clQuery = NULL;
+     char *clQueryRange = NULL;
+     char *clGpsIndex = NULL;
+     char *clFind = NULL;
+     char *clBox = NULL;
+     char *clPolygon = NULL;
+     char *clTargets[MAX_TARGETS];
+     int clTargetCnt = 0;
+     char *clArchive = NULL;
+     float clTempLow = 0;
+     float clTempHigh = 0;
      char clOutputDataFilename[] = "dataout.out"; 
      char clSLGInputFilename[] = "lg.slg";
      /* command line slg filename */
@@ -156,20 +843,347 @@ int main(int argc, char **argv){
      char *dataoutfile = clOutputDataFilename;
      /* file prepend string init to empty */
      char fileprepend[64]={0};
+     /* source and colormap setup message */
+     char error[ERROR_SIZE];
   
      //printf("%d", sizeof(word));
   
      for(i=0;i<argc;++i){
   
+          /* --channel SL2/SL3 channel */
+          if(!strcmp(argv[i], "--channel")){
+               if(argv[i+1]!=NULL){
+                    printf("\n--channel ");
+                    printf("%s \n", argv[i+1]);
+                    clChannel = atoi(argv[++i]);
+               }
+               continue;
+          }
+
+          /* --hugepages worker arenas on huge pages */
+          if(!strcmp(argv[i], "--hugepages")){
+               clHugePages = 1;
+               continue;
+          }
+
+          /* --stats resource usage report */
+          if(!strcmp(argv[i], "--stats")){
+               clStats = 1;
+               continue;
+          }
+
+          /* --mem-limit memory budget for the sections in flight */
+          if(!strcmp(argv[i], "--mem-limit")){
+               if(argv[i+1]!=NULL){
+                    clMemLimit = parse_size(argv[++i]);
+                    if(clMemLimit<=0)
+                         abort_("--mem-limit needs a size such as 512M or 2G");
+               }
+               continue;
+          }
+
+          /* --archive convert the scanned pages to a chunked archive */
+          if(!strcmp(argv[i], "--archive")){
+               if(argv[i+1]!=NULL)
+                    clArchive = argv[++i];
+               continue;
+          }
+
+          /* --temp-range fixed temperature palette range, F */
+          if(!strcmp(argv[i], "--temp-range")){
+               if(argv[i+1]!=NULL){
+                    if(sscanf(argv[++i], "%f:%f", &clTempLow, &clTempHigh)!=2||clTempHigh<=clTempLow)
+                         abort_("--temp-range needs low:high in F");
+               }
+               continue;
+          }
+
+          /* --summary write the page summary tree */
+          if(!strcmp(argv[i], "--summary")){
+               if(argv[i+1]!=NULL)
+                    clSummary = argv[++i];
+               continue;
+          }
+
+          /* --query range of a summary file */
+          if(!strcmp(argv[i], "--query")){
+               if(argv[i+1]!=NULL&&argv[i+2]!=NULL){
+                    clQuery = argv[++i];
+                    clQueryRange = argv[++i];
+               }
+               continue;
+          }
+
+          /* --gps-index write the position index */
+          if(!strcmp(argv[i], "--gps-index")){
+               if(argv[i+1]!=NULL)
+                    clGpsIndex = argv[++i];
+               continue;
+          }
+
+          /* --find page runs of an index inside the area */
+          if(!strcmp(argv[i], "--find")){
+               if(argv[i+1]!=NULL)
+                    clFind = argv[++i];
+               continue;
+          }
+
+          /* --bbox area to render */
+          if(!strcmp(argv[i], "--bbox")){
+               if(argv[i+1]!=NULL)
+                    clBox = argv[++i];
+               continue;
+          }
+
+          /* --polygon area to render */
+          if(!strcmp(argv[i], "--polygon")){
+               if(argv[i+1]!=NULL)
+                    clPolygon = argv[++i];
+               continue;
+          }
+
+          /* --target another output from the same read */
+          if(!strcmp(argv[i], "--target")){
+               if(argv[i+1]!=NULL){
+                    if(clTargetCnt==MAX_TARGETS-1)
+                         abort_("At most %d --target outputs", MAX_TARGETS-1);
+                    clTargets[clTargetCnt++] = argv[++i];
+               }
+               continue;
+          }
+
+          /* --threads worker count */
+          if(!strcmp(argv[i], "--threads")){
+               if(argv[i+1]!=NULL){
+                    clThreads = atoi(argv[++i]);
+                    if(clThreads<1)clThreads = 1;
+                    if(clThreads>MAX_THREADS)clThreads = MAX_THREADS;
+               }
+               continue;
+          }
+
+          /* --affinity worker placement */
+          if(!strcmp(argv[i], "--affinity")){
+               if(argv[i+1]!=NULL){
+                    ++i;
+                    if(!strcmp(argv[i], "core"))clAffinity = AFFINITY_CORE;
+                    else if(!strcmp(argv[i], "node"))clAffinity = AFFINITY_NODE;
+                    else abort_("Unknown affinity %s", argv[i]);
+               }
+               continue;
+          }
+
+          /* --io-uring asynchronous I/O */
+          if(!strcmp(argv[i], "--io-uring")){
+               clIoUring = 1;
+               continue;
+          }
+
+          /* --direct O_DIRECT reads */
+          if(!strcmp(argv[i], "--direct")){
+               clDirect = 1;
+               continue;
+          }
+
+          /* --brightness compensation */
+          if(!strcmp(argv[i], "--brightness")){
+               if(argv[i+1]!=NULL)
+                    clBrightness = atoi(argv[++i]);
+               continue;
+          }
+
+          /* --autolevels with optional percentiles */
+          if(!strcmp(argv[i], "--autolevels")){
+               clAutoLevels = 1;
+               if(argv[i+1]!=NULL&&sscanf(argv[i+1], "%f,%f", &clLevelLow, &clLevelHigh)==2)
+                    ++i;
+               continue;
+          }
+
+          /* --tvg time varied gain, spread and optional absorption */
+          if(!strcmp(argv[i], "--tvg")){
+               if(argv[i+1]!=NULL){
+                    clFilters.tvg_alpha = 0;
+                    if(sscanf(argv[++i], "%f,%f", &clFilters.tvg_spread, &clFilters.tvg_alpha)<1)
+                         abort_("--tvg needs spread[,alpha] gains");
+                    filters = &clFilters;
+               }
+               continue;
+          }
+
+          /* --despeckle 3x3 median */
+          if(!strcmp(argv[i], "--despeckle")){
+               clFilters.median = 1;
+               filters = &clFilters;
+               continue;
+          }
+
+          /* --smooth passes across pages */
+          if(!strcmp(argv[i], "--smooth")){
+               if(argv[i+1]!=NULL){
+                    clFilters.smooth = atoi(argv[++i]);
+                    if(clFilters.smooth<1)
+                         abort_("--smooth needs a number of passes");
+                    filters = &clFilters;
+               }
+               continue;
+          }
+
+          /* --bottom tracking */
+          if(!strcmp(argv[i], "--bottom")){
+               clBottom = 1;
+               continue;
+          }
+
+          /* --roi depth band to render */
+          if(!strcmp(argv[i], "--roi")){
+               if(argv[i+1]!=NULL){
+                    if(sscanf(argv[++i], "%f,%f", &clRoiTop, &clRoiBottom)!=2||clRoiTop<0||clRoiBottom<=clRoiTop)
+                         abort_("--roi needs top,bottom depths, top above bottom");
+               }
+               continue;
+          }
+
+          /* --depth-scale common depth grid */
+          if(!strcmp(argv[i], "--depth-scale")){
+               if(argv[i+1]!=NULL){
+                    clDepthScale = atof(argv[++i]);
+                    if(!(clDepthScale>0))
+                         abort_("--depth-scale needs a depth per row above 0");
+               }
+               continue;
+          }
+
+          /* --overview fixed width image of the whole run */
+          if(!strcmp(argv[i], "--overview")){
+               if(argv[i+1]!=NULL)
+                    clOverview = atoi(argv[++i]);
+               continue;
+          }
+
+          /* --pool overview pooling */
+          if(!strcmp(argv[i], "--pool")){
+               if(argv[i+1]!=NULL){
+                    ++i;
+                    if(!strcmp(argv[i], "mean"))clPool = POOL_MEAN;
+                    else if(!strcmp(argv[i], "max"))clPool = POOL_MAX;
+                    else abort_("Unknown pooling %s", argv[i]);
+               }
+               continue;
+          }
+
+          /* --colormap echo colors */
+          if(!strcmp(argv[i], "--colormap")){
+               if(argv[i+1]!=NULL)
+                    clColormap = argv[++i];
+               continue;
+          }
+
+          /* --tempmap temperature strip colors */
+          if(!strcmp(argv[i], "--tempmap")){
+               if(argv[i+1]!=NULL)
+                    clTempmap = argv[++i];
+               continue;
+          }
+
+          /* --shard i/N render a share of the images */
+          if(!strcmp(argv[i], "--shard")){
+               if(argv[i+1]!=NULL){
+                    ++i;
+                    if(sscanf(argv[i], "%d/%d", &clShard, &clShards)!=2||clShards<1||clShard<0||clShard>=clShards)
+                         abort_("Bad shard %s, expected i/N", argv[i]);
+               }
+               continue;
+          }
+
+          /* --merge combine shard manifests and data */
+          if(!strcmp(argv[i], "--merge")){
+               clMerge = 1;
+               continue;
+          }
+
+          /* --out images to stdout or a descriptor */
+          if(!strcmp(argv[i], "--out")){
+               if(argv[i+1]!=NULL){
+                    ++i;
+                    if(!strcmp(argv[i], "-")){
+                         /* images take stdout, messages move to stderr */
+                         clSinkFd = dup(1);
+                         dup2(2, 1);
+                    }else if(sscanf(argv[i], "fd:%d", &clSinkFd)!=1||fcntl(clSinkFd, F_GETFD)<0)
+                    {
+                         abort_("Bad output %s, expected - or fd:N", argv[i]);
+                    }
+               }
+               continue;
+          }
+
+          /* --frames length-prefixed images on the output */
+          if(!strcmp(argv[i], "--frames")){
+               clFramed = 1;
+               continue;
+          }
+
+          /* --cache render cache directory */
+          if(!strcmp(argv[i], "--cache")){
+               if(argv[i+1]!=NULL)
+                    clCache = argv[++i];
+               continue;
+          }
+
+          /* --rows one image, a row per page */
+          if(!strcmp(argv[i], "--rows")){
+               clRows = 1;
+               continue;
+          }
+
           if(strstr(argv[i], "-h")){
              printf("-h                        Help\n");
              printf("-v                        Verbose\n");
              printf("-t [pages]                Total echogram pages to process\n");
              printf("-s [offset]               Start offest into SLG file\n");
              printf("-d [filename]             Create Data CSV file\n");
-             printf("-f [filename]             SLG filename to process\n");
+             printf("-f [filename]             SLG filename to process, plain, bgzip or seekable zstd\n");
              printf("-x [pages]                Multiple PNG output files\n");
              printf("-p [fileprepend]          Prepend to output image files\n");
+             printf("--channel [n]             Sonar channel to render from SL2/SL3 logs\n");
+             printf("--hugepages               Back worker arenas with huge pages\n");
+             printf("--stats                   Report time, page faults and RSS\n");
+             printf("--threads [n]             Worker threads (default %d)\n", THREADS);
+             printf("-f -                      Read the SLG log from stdin, rendered as it arrives\n");
+             printf("--archive [file]          Convert the log's pages to a compact chunked archive, -f reads it back\n");
+             printf("--temp-range [low:high]   Fixed temperature palette range in F, streamed runs follow the pages so far\n");
+             printf("--summary [file]          Write min, max and mean of temperature and depth over page ranges\n");
+             printf("--query [file] [a:b]      Min, max and mean over pages a to b of a summary file, no log needed\n");
+             printf("--target [key=value,...]  Another output from the same read: prefix, colormap, tempmap,\n");
+             printf("                          roi=top:bottom, depth-scale, scale, level (zlib), overview\n");
+             printf("--gps-index [file]        Write a grid index of the page positions\n");
+             printf("--bbox [lat,lon,lat,lon]  Render only the pages inside the box\n");
+             printf("--polygon [lat,lon;...]   Render only the pages inside the polygon\n");
+             printf("--find [file]             Page runs of a --gps-index file inside --bbox or --polygon, no log needed\n");
+             printf("--mem-limit [size]        Run only as many sections at once as fit, K, M or G suffix\n");
+             printf("--affinity [core|node]    Pin workers, each node renders a contiguous file region\n");
+             printf("--io-uring                Asynchronous reads and writes through io_uring\n");
+             printf("--direct                  O_DIRECT reads, keep archive runs out of the page cache\n");
+             printf("--brightness [n]          Brightness compensation (default %d)\n", BRIGHTNESS_COMPENSATION);
+             printf("--autolevels [low,high]   Percentile auto levels per depth band (default 1,99)\n");
+             printf("--tvg [spread[,alpha]]    Time varied gain, spread*log10(depth)+2*alpha*depth echo counts\n");
+             printf("--despeckle               3x3 median over the echo gram\n");
+             printf("--smooth [passes]         Smooth the echo across neighbouring pages, [1 2 1] a pass\n");
+             printf("--bottom                  Track the bottom, draw it and add it to the data CSV. The median over\n");
+             printf("                          pages runs across images, streamed input within each image\n");
+             printf("--rows                    One image with a row per page, streamed as sections finish\n");
+             printf("--colormap [name|file]    Echo colors, grey (default), temp, grad or a file of r g b lines\n");
+             printf("--tempmap [name|file]     Temperature strip colors, temp (default), grey, grad or a file\n");
+             printf("--shard [i/N]             Render shard i of N, images keep their single run numbers\n");
+             printf("--merge                   Combine the shard manifests and data files of -p and -d\n");
+             printf("--out [-|fd:N]            Write images in order to stdout or descriptor N, not files\n");
+             printf("--frames                  Prefix each --out image with SLGI, index (u32), length (u64)\n");
+             printf("--cache [dir]             Reuse images rendered before from the same pages and settings\n");
+             printf("--roi [top,bottom]        Render only the depth band from top to bottom (log depth units)\n");
+             printf("--depth-scale [depth]     Resample every page to depth per image row (log depth units)\n");
+             printf("--overview [width]        Overview of the whole run, pages pooled into width columns\n");
+             printf("--pool [mean|max]         Overview pooling (default mean)\n");
              printf("\n\n");
              exit(0);
           }
@@ -185,6 +1199,7 @@ int main(int argc, char **argv){
                printf("\n-cnt ");
                printf("%s\n", argv[i+1]);
                clPageCount = atoi(argv[i+1]);
+               clPageCountSet = 1;
                }
           }
   
@@ -249,8 +1264,111 @@ int main(int argc, char **argv){
      exit(0);
      */
 
+     /* answer a range query from a summary file and stop */
+     if(clQuery){
+          summary_tree summary;
+          summary_stat stats[SUMMARY_FIELDS];
+          char *field_names[SUMMARY_FIELDS] = {"temperature", "depth", "depth_limit"};
+          int first, last, f;
+          summary_read(&summary, clQuery);
+          if(sscanf(clQueryRange, "%d:%d", &first, &last)!=2)
+               abort_("--query needs a page range first:last");
+          if(first<0)first = 0;
+          if(last>=summary.pages)last = summary.pages-1;
+          if(first>last)
+               abort_("Pages %s are outside the %d pages of %s", clQueryRange, summary.pages, clQuery);
+          summary_query(&summary, first, last, stats);
+          printf("pages %d %d\n", first, last);
+          for(f=0;f<SUMMARY_FIELDS;++f){
+               if(stats[f].count)
+                    printf("%s %f %f %f %d\n", field_names[f], stats[f].min, stats[f].max,
+                           stats[f].sum/stats[f].count, stats[f].count);
+               else
+                    printf("%s - - - 0\n", field_names[f]);
+          }
+          summary_free(&summary);
+          return 0;
+     }
+
+     /* the area to select pages by */
+     gps_shape shape;
+     if(clBox||clPolygon)
+          gps_shape_parse(&shape, clBox, clPolygon);
+
+     /* page runs of an index file inside the area and stop */
+     if(clFind){
+          gps_index idx;
+          int *runs, run_cnt, r;
+          if(!clBox&&!clPolygon)
+               abort_("--find needs --bbox or --polygon");
+          gps_index_read(&idx, clFind);
+          run_cnt = gps_index_query(&idx, &shape, &runs);
+          for(r=0;r<run_cnt;++r)
+               printf("run %d %d\n", runs[2*r], runs[2*r+1]);
+          printf("%d runs\n", run_cnt);
+          free(runs);
+          gps_index_free(&idx);
+          return 0;
+     }
+
+     /* merge the shards of an earlier run and stop */
+     if(clMerge){
+          merge_shards(fileprepend, clOutputDataFile ? dataoutfile : NULL);
+          return 0;
+     }
+
+     if(clFramed&&clSinkFd<0)
+          abort_("--frames needs --out");
+     if(clTargetCnt&&(clRows||clSinkFd>=0||clShards))
+          abort_("--target writes image files, not with --rows, --out or --shard");
+     if(clFramed&&clRows)
+          abort_("--rows streams one image of unknown length, use --out without --frames");
+
+     /* each shard writes its own data file */
+     char shard_dataout[256];
+     if(clShards){
+          if(clRows||clOverview>0)
+               abort_("--shard renders section images, not --rows or --overview");
+          snprintf(shard_dataout, sizeof(shard_dataout), "%s.%d", dataoutfile, clShard);
+          dataoutfile = shard_dataout;
+     }
+
+     struct timeval time_start, time_end;
+     gettimeofday(&time_start, NULL);
+
+     /* the render targets, the command line's first */
+     render_target targets[MAX_TARGETS];
+     int target_cnt = 1+clTargetCnt;
+     memset(&targets[0], 0, sizeof(render_target));
+     targets[0].prefix = fileprepend;
+     targets[0].colormap_name = clColormap;
+     targets[0].tempmap_name = clTempmap;
+     targets[0].roi_top = clRoiTop;
+     targets[0].roi_bottom = clRoiBottom;
+     targets[0].depth_scale = clDepthScale;
+     targets[0].scale = 1;
+     targets[0].level = -1;
+     targets[0].overview_width = clOverview;
+     for(i=1;i<target_cnt;++i)
+          target_parse(&targets[i], &targets[0], clTargets[i-1]);
+
+     /* render cache */
+     int cache_hits = 0;
+     if(clCache&&mkdir(clCache, 0755)!=0&&errno!=EEXIST)
+          abort_("Cache directory %s could not be created", clCache);
+
+     /* images to a descriptor go out in image order */
+     output_sink sink;
+     if(clSinkFd>=0){
+          sink.fd = clSinkFd;
+          sink.framed = clFramed;
+          sink.next = 0;
+          pthread_mutex_init(&sink.mutex, NULL);
+          pthread_cond_init(&sink.turn, NULL);
+     }
+
      /* FILES */
-     FILE *fpOutfile;   // Datafile output
+     FILE *fpOutfile = NULL;   // Datafile output
      FILE *fp;          // SLG Fiel
      // open CSV data file 
      if(clOutputDataFile){
@@ -258,7 +1376,104 @@ int main(int argc, char **argv){
           if (!fpOutfile)
                abort_("Data CSV File %s could not be opened for reading", dataoutfile);
      }
-  
+
+     /* pages from a pipe, read in order and rendered as they arrive */
+     if(!strcmp(filename, "-")){
+          thread_section_data base;
+          stream_input si;
+          int stream_height = 0;
+          int stream_threads = clThreads;
+          int pages;
+
+          if(clRows||clOverview>0||clShards||clBox||clPolygon||clSummary||clGpsIndex||clAffinity||clArchive)
+               abort_("Streamed input renders section images, not with --rows, --overview, --shard, --bbox, --polygon, --summary, --gps-index, --affinity or --archive");
+          if(clMaxImgPages<=0)
+               abort_("Streamed input needs -x pages per image");
+          for(i=0;i<target_cnt;++i){
+               if(targets[i].roi_bottom>0||targets[i].depth_scale>0||targets[i].overview_width>0)
+                    abort_("--roi, --depth-scale and --overview need the page scan, not streamed input");
+               targets[i].height = target_height(&targets[i], NULL, 0, clVerbose);
+               if(targets[i].height>stream_height)stream_height = targets[i].height;
+               if(build_colormap(&targets[i].colormap, targets[i].colormap_name, targets[i].tempmap_name, clBrightness, error))
+                    abort_("%s", error);
+          }
+
+          /* sections in flight within the budget */
+          if(clMemLimit>0){
+               long long per = section_bytes(clMaxImgPages, stream_height, clSinkFd>=0||clIoUring, 0, filters!=NULL)+
+                               (long long)sizeof(processed_page_data)*clMaxImgPages;
+               if(per>clMemLimit)
+                    abort_("--mem-limit %lld is too small for a section of %d pages", clMemLimit, clMaxImgPages);
+               if(per*stream_threads>clMemLimit)
+                    stream_threads = clMemLimit/per;
+               if(clVerbose)printf("Memory: %d sections of %d pages at once, %lld bytes each of %lld\n",
+                                   stream_threads, clMaxImgPages, per, clMemLimit);
+          }
+
+          memset(&si, 0, sizeof(stream_input));
+          si.fd = 0;
+          si.data = malloc(STREAM_BUFFER);
+          if(!si.data)
+               abort_("Failed to allocate memory for the input stream.");
+          si.scan.last_flags = -1;
+          si.prev = -1;
+
+          /* SL2/SL3 logs are indexed by block ahead of rendering */
+          if(stream_fill(&si, FILE_HEADER_SIZE)<FILE_HEADER_SIZE)
+               abort_("Insufficient Sonar Data in SLG stream");
+          if(detect_format((unsigned char*) si.data))
+               abort_("Streamed input takes SLG logs, SL2/SL3 need -f with a file");
+          si.pos = FILE_HEADER_SIZE;
+
+          memset(&base, 0, sizeof(thread_section_data));
+          base.sonar_size = SONAR_SIZE;
+          base.verbose = clVerbose;
+          base.temprscan = 1;
+          base.brightness = clBrightness;
+          base.autolevels = clAutoLevels;
+          base.level_low = clLevelLow;
+          base.level_high = clLevelHigh;
+          base.bottom = clBottom;
+          base.filters = filters;
+          base.height = stream_height;
+          base.targets = targets;
+          base.target_cnt = target_cnt;
+          base.sink = clSinkFd>=0 ? &sink : NULL;
+          base.cache_dir = clCache;
+          base.cache_hits = &cache_hits;
+          base.inputfile = filename;
+
+          pages = stream_run(&base, &si, stream_threads, clMaxImgPages, clOffset, clPageCountSet ? clPageCount : 0,
+                             clHugePages, clIoUring, clTempLow, clTempHigh, clOutputDataFile ? fpOutfile : NULL);
+          if(!pages)
+               abort_("No valid sonar pages in the stream");
+          free(si.data);
+
+          if(clSinkFd>=0){
+               close(clSinkFd);
+               pthread_mutex_destroy(&sink.mutex);
+               pthread_cond_destroy(&sink.turn);
+          }
+          if(clCache&&clVerbose)
+               printf("Cache: %d of %d images reused\n", cache_hits,
+                      target_cnt*((pages+clMaxImgPages-1)/clMaxImgPages));
+          if(clAutoLevels&&clVerbose)
+               printf("Echo levels: %d at %.1f%%  %d at %.1f%%\n",
+                    histogram_level(targets[0].run_histogram, clLevelLow), clLevelLow,
+                    histogram_level(targets[0].run_histogram, clLevelHigh), clLevelHigh);
+          if(clStats){
+               struct rusage usage;
+               gettimeofday(&time_end, NULL);
+               getrusage(RUSAGE_SELF, &usage);
+               printf("\nElapsed: %.3f s   Pages: %d\n",
+                    (time_end.tv_sec-time_start.tv_sec)+(time_end.tv_usec-time_start.tv_usec)/1e6, pages);
+               printf("Page faults: %ld minor  %ld major   Max RSS: %ld KB\n",
+                    usage.ru_minflt, usage.ru_majflt, usage.ru_maxrss);
+          }
+          if(clOutputDataFile)fclose(fpOutfile);
+          return 0;
+     }
+
      /* open slg file */
      fp = fopen(filename, "rb");
      if (!fp)
@@ -268,7 +1483,7 @@ int main(int argc, char **argv){
      int total_pages_to_process = clPageCount; // total pages to process
      int sonar_page_count = 0;                 // total page count in file 
      int sonar_page_offset = clOffset;         // page offset into file to start processing  
-     int sonar_data_offset = 0;                // offset into file in bytes
+     off_t sonar_data_offset = 0;              // offset into file in bytes
      int sonar_size = SONAR_SIZE;              // page sonar size
      int sonar_offset = 0;                     // 2800*$sonar_size;
      int total_pages_processed;
@@ -277,49 +1492,173 @@ int main(int argc, char **argv){
 	
 	float maxtemp = 0;
      float mintemp = 0;
+     summary_tree summary;
+     memset(&summary, 0, sizeof(summary_tree));
   
-     /* do scan for temp data */
-     void* pg_ptr;
-     page_data* pd_ptr;
-     int total_pages_read = 0;
-     processed_page_data* page_data_store_ptr;  
+     int sonar_structure_size = sizeof(raw_sonar_page);
+     if(clVerbose)printf("\nSonar Page Size: %i\n", sonar_structure_size);
   
-     if(temprscan){
-          pg_ptr = malloc(sizeof(page_data));
-          pd_ptr = (page_data*)pg_ptr;
-
-          page_data_store_ptr =  malloc(sizeof(processed_page_data)*total_pages_to_process);
-    
-          if(pg_ptr&&page_data_store_ptr){
-
-               float temprC = 0;
-               float temprF = 0;
-               double lat, lon;
-               int theFlags;
-
-               float tempinit = 0;
-
-               fseek(fp, sonar_data_offset+(sizeof(file_header))+sizeof(page_data), SEEK_SET);
-    
-               for(i=0;i<total_pages_to_process;++i){
+     /* sonar data stuctures */
+     file_header fileheader;
+  
+     /* get SLG file information, compressed logs report their log size */
+     slg_source source;
+     off_t data_file_size;
 
-                    fseek(fp, (sonar_size)-sizeof(page_data), SEEK_CUR);
-                    total_pages_read = fread(pg_ptr, sizeof(page_data), 1, fp);
+     if(source_open(&source, filename, error))
+          abort_("%s", error);
+     data_file_size = source.size;
+  
+     if(clVerbose)printf("Start of processing for : %s        size: %lld\n", filename, (long long)data_file_size); 
+     if(clVerbose&&source.type!=SOURCE_PLAIN)
+          printf("%s compressed, %d frames\n", source.type==SOURCE_BGZF ? "BGZF" : source.type==SOURCE_ZSTD ? "Seekable zstd" : "Archive",
+                 source.frame_count);
 
-                    theFlags = (pd_ptr->flags)>>16;
+     /* Read SLG file header */
+     memset(&fileheader, 0, sizeof(fileheader));
+     total_bytes = source_pread(&source, &fileheader, sizeof(fileheader), 0);
+  
+     /* Output header bytes   */
+     total_bytes = sizeof(fileheader);
+     unsigned char *pFileHeader = (unsigned char*) &fileheader;
+     if(clVerbose){
+          printf("SLG File Header\n");
+          for(i=0;i<total_bytes;i++){
+               printf("%02x", *pFileHeader++);
+               printf(" ");
+          }
+          printf("\n");
+     }
 
-                    if(theFlags==0x2c11||theFlags==0x6d14){
-                    temprC = pd_ptr->tempr;
-                    temprF = (1.8*pd_ptr->tempr)+32;
-                    if(tempinit){
-                         if(temprF>maxtemp)maxtemp=temprF;
-                         if(temprF<mintemp)mintemp=temprF;
+     /* SL2/SL3 logs are indexed by block, pages are the blocks of one channel */
+     block_layout *layout = detect_format((unsigned char*) &fileheader);
+     block_index blockindex = {0};
+     int *channel_blocks = NULL;
+
+     if(layout){
+          if(clVerbose)printf("%s log, indexing blocks\n", layout->name);
+          if(!build_block_index(&source, layout, THREADS, &blockindex))
+               abort_("No %s blocks found in %s", layout->name, filename);
+
+          channel_blocks = malloc(sizeof(int)*blockindex.count);
+          if(!channel_blocks)
+               abort_("Failed to allocate memory for channel index.");
+          for(i=0;i<blockindex.count;++i){
+               if(blockindex.blocks[i].channel==clChannel)
+                    channel_blocks[sonar_page_count++] = i;
+          }
+          if(clVerbose)printf("Blocks: %d   Channel %d Pages: %d\n", blockindex.count, clChannel, sonar_page_count);
+          if(!sonar_page_count)
+               abort_("No blocks for channel %d in %s", clChannel, filename);
+     }else if(source.type==SOURCE_ARCHIVE)
+     {
+          sonar_page_count = source.page_count;
+          if(clVerbose)printf("Archive Pages: %d\n", sonar_page_count);
+     }else
+     {
+          /* calc file sonar page count  */
+          if(data_file_size>(sonar_size*2)){
+               sonar_page_count = (data_file_size / sonar_size)-1;
+               if(clVerbose)printf("Sonar Pages: %d\n", sonar_page_count);
+          }else
+          {
+               abort_("Insufficient Sonar Data in SLG file");
+          }
+          /* pages past the end of the file are dropped below, a
+           * truncated log renders what it has */
+     }
+     
+     if(sonar_page_offset>=(sonar_page_count-10))
+          abort_("Sonar Page offset past end of total sonar page.");
+     
+     /* an archive takes the whole log unless -t is given */
+     if(clArchive&&!clPageCountSet)
+          total_pages_to_process = sonar_page_count-sonar_page_offset;
+
+     if((sonar_page_offset+total_pages_to_process)>sonar_page_count)
+          total_pages_to_process = sonar_page_count - sonar_page_offset;
+
+     if(clVerbose)printf("\nProcessing %d pages\n", total_pages_to_process);
+
+     /* do scan for temp data */
+     void* pg_ptr;
+     page_data* pd_ptr;
+     processed_page_data* page_data_store_ptr;  
+  
+     if(temprscan){
+          pg_ptr = malloc(sizeof(page_data));
+          pd_ptr = (page_data*)pg_ptr;
+
+          page_data_store_ptr =  malloc(sizeof(processed_page_data)*total_pages_to_process);
+    
+          if(pg_ptr&&page_data_store_ptr){
+
+               float temprC = 0;
+               float temprF = 0;
+               double lat, lon;
+               int theFlags;
+               off_t page_pos;
+               sonar_block *blk = NULL;
+               processed_page_data *hdr = NULL;
+
+               /* SLG pages are validated as they are scanned, damaged
+                * ranges are skipped up to the next valid page */
+               page_scan scan;
+               off_t page_next, page_prev = -1;
+
+               sonar_data_offset = FILE_HEADER_SIZE + (off_t)sonar_page_offset*sonar_size;
+               page_next = sonar_data_offset;
+               memset(&scan, 0, sizeof(page_scan));
+               scan.src = &source;
+               scan.file_size = data_file_size;
+               scan.last_flags = -1;
+    
+               for(i=0;i<total_pages_to_process;++i){
+
+                    if(layout){
+                         /* header values come straight from the block index */
+                         blk = &blockindex.blocks[channel_blocks[sonar_page_offset+i]];
+                         memset(pd_ptr, 0, sizeof(page_data));
+                         pd_ptr->flags = 0x2c11<<16;
+                         pd_ptr->depth_limit_bottom = blk->lower_limit;
+                         pd_ptr->depth_hard = blk->depth;
+                         pd_ptr->tempr = blk->tempr;
+                         page_pos = blk->offset;
+                    }else if(source.headers)
+                    {
+                         /* archived pages are valid, the header columns
+                          * stand in for the scan */
+                         hdr = &source.headers[sonar_page_offset+i];
+                         memset(pd_ptr, 0, sizeof(page_data));
+                         pd_ptr->flags = hdr->flags<<16;
+                         pd_ptr->depth_limit_bottom = hdr->depth_limit_bottom;
+                         pd_ptr->depth_hard = hdr->depth_hard;
+                         pd_ptr->tempr = hdr->temprc;
+                         page_pos = FILE_HEADER_SIZE+(off_t)(sonar_page_offset+i)*sonar_size;
                     }else
                     {
-                         maxtemp=temprF;
-                         mintemp=temprF;
-                         tempinit = 1;
+                         page_pos = scan_page(&scan, page_next, page_prev<0 ? page_next : page_prev+1, pd_ptr);
+                         if(page_pos<0){
+                              if(page_next<data_file_size)
+                                   fprintf(stderr, "Skipped %lld-%lld, no valid pages to end of file\n",
+                                           (long long)page_next, (long long)data_file_size);
+                              break;
+                         }
+                         if(page_pos>page_next)
+                              fprintf(stderr, "Skipped %lld-%lld, resync at page %d\n",
+                                      (long long)page_next, (long long)page_pos, i);
+                         if(page_pos<page_next)
+                              fprintf(stderr, "Page %d at %lld short by %lld bytes\n", i-1,
+                                      (long long)page_prev, (long long)(page_next-page_pos));
+                         page_prev = page_pos;
+                         page_next = page_pos+sonar_size;
                     }
+
+                    theFlags = (pd_ptr->flags)>>16;
+
+                    if(theFlags==0x2c11||theFlags==0x6d14){
+                    temprC = pd_ptr->tempr;
+                    temprF = (1.8*pd_ptr->tempr)+32;
                     }else
                     {
                          temprC = -100;
@@ -327,7 +1666,14 @@ int main(int argc, char **argv){
                     }
 
                     /* GPS data present */
-                    if(theFlags==0x6d14){
+                    if(layout&&(blk->lat||blk->lon)){
+                         lat = latconvert(blk->lat);
+                         lon = lonconvert(blk->lon);
+                    }else if(source.headers)
+                    {
+                         lat = hdr->lat;
+                         lon = hdr->lon;
+                    }else if(theFlags==0x6d14){
                      
                          lat = latconvert(pd_ptr->position_latitude);
                          lon = lonconvert(pd_ptr->position_longitude);
@@ -339,7 +1685,9 @@ int main(int argc, char **argv){
                     }
 
                     if(page_data_store_ptr){
-                         page_data_store_ptr[i].ordinal = i;
+                         /* ordinals count from the offset, an archive's
+                          * from the offset into its source log */
+                         page_data_store_ptr[i].ordinal = source.headers ? hdr->ordinal-sonar_page_offset : i;
                          page_data_store_ptr[i].flags = theFlags;
                          page_data_store_ptr[i].temprf = temprF;
                          page_data_store_ptr[i].temprc = temprC;
@@ -347,6 +1695,9 @@ int main(int argc, char **argv){
                          page_data_store_ptr[i].lon = lon;
                          page_data_store_ptr[i].depth_hard = pd_ptr->depth_hard;
                          page_data_store_ptr[i].depth_limit_bottom =  pd_ptr->depth_limit_bottom;
+                         page_data_store_ptr[i].offset = page_pos;
+                         page_data_store_ptr[i].size = layout ? layout->header_size+blk->packet_size : sonar_size;
+                         page_data_store_ptr[i].bottom_depth = -1;
                     }
 
                     /*
@@ -356,6 +1707,45 @@ int main(int argc, char **argv){
 
                }
       
+               /* pages lost to damage or the end of the file */
+               if(!layout&&!source.headers&&i<total_pages_to_process){
+                    fprintf(stderr, "%d of %d pages found\n", i, total_pages_to_process);
+                    total_pages_to_process = i;
+               }
+               if(!layout&&clVerbose&&scan.resyncs)
+                    printf("Resyncs: %d   Skipped bytes: %lld\n", scan.resyncs, (long long)scan.skipped);
+               free(scan.data);
+               if(!total_pages_to_process)
+                    abort_("No valid sonar pages in %s", filename);
+
+               /* the temperature range comes from the summary tree */
+               summary_stat run_stats[SUMMARY_FIELDS];
+               summary_build(&summary, page_data_store_ptr, total_pages_to_process);
+               summary_query(&summary, 0, total_pages_to_process-1, run_stats);
+               if(run_stats[SUMMARY_TEMP].count){
+                    mintemp = run_stats[SUMMARY_TEMP].min;
+                    maxtemp = run_stats[SUMMARY_TEMP].max;
+               }
+               if(clTempHigh>clTempLow){
+                    mintemp = clTempLow;
+                    maxtemp = clTempHigh;
+               }
+               if(clSummary){
+                    summary_write(&summary, clSummary);
+                    if(clVerbose)printf("Summary of %d pages, %d levels in %s\n", summary.pages, summary.levels, clSummary);
+               }
+
+               /* positions of the pages */
+               gps_index gps;
+               int gps_built = 0;
+               if(clGpsIndex||clBox||clPolygon){
+                    gps_index_build(&gps, page_data_store_ptr, total_pages_to_process);
+                    gps_built = 1;
+                    if(clVerbose)printf("Positions: %d of %d pages, %dx%d grid\n", gps.fixes, gps.pages, gps.dim, gps.dim);
+               }
+               if(clGpsIndex)
+                    gps_index_write(&gps, clGpsIndex);
+
       /*  Over Process */
 #ifdef DISPLAY_TESTDATA       
                for(i=0;i<total_pages_to_process;++i){
@@ -375,80 +1765,121 @@ int main(int argc, char **argv){
       
                printf("Max %f, %f Min", maxtemp, mintemp);  
 #endif      
+
+               page_palettes(page_data_store_ptr, total_pages_to_process, mintemp, maxtemp);
+
+               /* only the page runs inside the area are rendered, back to
+                * back. Palettes are set over the whole run first so the
+                * colors match a full render */
+               if(clBox||clPolygon){
+                    int *runs, run_cnt, r, n = 0;
+                    run_cnt = gps_index_query(&gps, &shape, &runs);
+                    if(!run_cnt)
+                         abort_("No pages of %s inside the area", filename);
+                    for(r=0;r<run_cnt;++r){
+                         if(clVerbose)printf("Run %d-%d\n", runs[2*r], runs[2*r+1]);
+                         memmove(&page_data_store_ptr[n], &page_data_store_ptr[runs[2*r]],
+                                 sizeof(processed_page_data)*(runs[2*r+1]-runs[2*r]+1));
+                         n += runs[2*r+1]-runs[2*r]+1;
+                    }
+                    if(clVerbose)printf("Area: %d runs, %d of %d pages\n", run_cnt, n, total_pages_to_process);
+                    total_pages_to_process = n;
+                    free(runs);
+               }
+               if(gps_built)gps_index_free(&gps);
     
           //free(page_data_store_ptr);
                free(pg_ptr);
           }
     
      }
-  
-     //fclose(fp);
-     //exit(0);
-     int sonar_structure_size = sizeof(raw_sonar_page);
-     if(clVerbose)printf("\nSonar Page Size: %i\n", sonar_structure_size);
-  
-     /* sonar data stuctures */
-     file_header fileheader;
-  
-     /* get SLG file information */
-     struct stat fileinfo;
-     int data_file_size;
 
-     if(0!=stat(filename, &fileinfo)){
-          if(clVerbose)printf("\nCould not determine file size.\n\n");
-          abort_("Could not determine file size of SLG File %s", filename);
+     /* the scanned pages go to an archive instead of images */
+     if(clArchive){
+          struct stat archive_info;
+          archive_write(clArchive, &source, layout, (char*) &fileheader, page_data_store_ptr,
+                        total_pages_to_process, sonar_page_offset, clThreads);
+          if(clVerbose&&stat(clArchive, &archive_info)==0)
+               printf("Archived %d pages to %s, %lld bytes for %lld\n", total_pages_to_process, clArchive,
+                      (long long)archive_info.st_size, (long long)total_pages_to_process*sonar_size);
+          free(page_data_store_ptr);
+          if(channel_blocks)free(channel_blocks);
+          if(blockindex.blocks)free(blockindex.blocks);
+          summary_free(&summary);
+          source_close(&source);
+          fclose(fp);
+          if(clOutputDataFile)fclose(fpOutfile);
+          return 0;
      }
-    
-     data_file_size = fileinfo.st_size;
-  
-     if(clVerbose)printf("Start of processing for : %s        size: %d\n", filename, (int)fileinfo.st_size); 
-    
-     /* calc file sonar page count  */
-     if(data_file_size>(sonar_size*2)){
-          sonar_page_count = (data_file_size / sonar_size)-1;
-          if(clVerbose)printf("Sonar Pages: %d\n", sonar_page_count);
-     }else
-     {
-          abort_("Insufficient Sonar Data in SLG file");
+
+     /* heights of the targets, arenas hold a page of the tallest */
+     int img_height = 0;
+     int resample = 0;
+     long long overview_bytes = 0;
+     for(i=0;i<target_cnt;++i){
+          if((targets[i].roi_bottom>0||targets[i].depth_scale>0)&&!page_data_store_ptr)
+               abort_("--roi and --depth-scale need the page scan");
+          targets[i].height = target_height(&targets[i], page_data_store_ptr, total_pages_to_process, clVerbose);
+          if(targets[i].height>img_height)img_height = targets[i].height;
+          if(targets[i].depth_scale>0)resample = 1;
+          if(targets[i].overview_width>0)
+               overview_bytes += (long long)targets[i].overview_width*(targets[i].height*3+1)*sizeof(unsigned int);
      }
 
-     if(clVerbose)printf("\nProcessing %d pages\n", total_pages_to_process);
-  
-     /* calc page and data offset into sonar file */
-     int total_data_size = total_pages_to_process * sonar_size;
-     sonar_data_offset = sonar_page_offset * SONAR_SIZE;
-     
-     if(total_data_size>data_file_size)
-          abort_("Sonar data offset past end of data file.");
-     
-     if(sonar_page_offset>=(sonar_page_count-10))
-          abort_("Sonar Page offset past end of total sonar page.");
-     
-     if((sonar_page_offset+total_pages_to_process)>sonar_page_count)
-          total_pages_to_process = sonar_page_count - sonar_page_offset;
+     /* admission, the sections in flight are held to the memory budget.
+      * Sections that fit run on fewer workers, sections too large for
+      * the budget on every worker are split into more images */
+     int mem_split = 0;               // pages the split images cover, 0 when not split
+     if(clMemLimit>0){
+          int encoded = clSinkFd>=0||clIoUring;
+          int pages = clMaxImgPages>0 ? clMaxImgPages : (total_pages_to_process+clThreads-1)/clThreads;
+          long long budget = clMemLimit;
+          long long per;
 
-     /* Read SLG file header */
-     fseek(fp, sonar_data_offset+8, SEEK_SET);
-     total_bytes = fread(&fileheader, sizeof(fileheader), 1, fp);
-  
-     /* Output header bytes   */
-     total_bytes = sizeof(fileheader);
-     unsigned char *pFileHeader = (unsigned char*) &fileheader;
-     if(clVerbose){
-          printf("SLG File Header\n");
-          for(i=0;i<total_bytes;i++){
-               printf("%02x", *pFileHeader++);
-               printf(" ");
+          /* memory taken whatever the sections */
+          budget -= (long long)sizeof(processed_page_data)*total_pages_to_process;
+          budget -= overview_bytes;
+          if(budget<(long long)section_bytes(1, img_height, encoded, resample, filters!=NULL))
+               abort_("--mem-limit %lld is too small for a section of one page", clMemLimit);
+
+          per = section_bytes(pages, img_height, encoded, resample, filters!=NULL);
+          if(per*clThreads>budget){
+               if(clMaxImgPages>0&&per<=budget){
+                    clThreads = budget/per;
+               }else
+               {
+                    /* largest section that fits on every worker, or on
+                     * as many as take a single page */
+                    int lo = 1, hi = pages, mid;
+
+                    /* the split images cover the pages the sections would have */
+                    mem_split = clMaxImgPages>0 ? total_pages_to_process/clMaxImgPages*clMaxImgPages :
+                                                  total_pages_to_process/clThreads*clThreads;
+                    while(clThreads>1&&(long long)section_bytes(1, img_height, encoded, resample, filters!=NULL)*clThreads>budget)
+                         clThreads--;
+                    while(lo<hi){
+                         mid = lo+(hi-lo+1)/2;
+                         if((long long)section_bytes(mid, img_height, encoded, resample, filters!=NULL)*clThreads<=budget)
+                              lo = mid;
+                         else
+                              hi = mid-1;
+                    }
+                    fprintf(stderr, "Sections of %d pages exceed --mem-limit, split to %d pages per image\n", pages, lo);
+                    clMaxImgPages = lo;
+                    pages = lo;
+               }
+               per = section_bytes(pages, img_height, encoded, resample, filters!=NULL);
           }
+          if(clVerbose)printf("Memory: %d sections of %d pages at once, %lld bytes each of %lld\n",
+                              clThreads, pages, per, clMemLimit);
      }
- 
+  
      /* Create Thread Specific structures */
-     #define THREADS 4
-     thread_section_data thread_data[THREADS];
-     int thread_cnt = THREADS;
+     thread_section_data thread_data[MAX_THREADS];
+     int thread_cnt = clThreads;
      int threads_started=0;
-     int threadret[THREADS];
-     pthread_t threads[THREADS];
+     int threadret[MAX_THREADS];
+     pthread_t threads[MAX_THREADS];
      thread_section_data* ptr_tdata;
      int pages_per_thread;
   
@@ -458,6 +1889,9 @@ int main(int argc, char **argv){
      if(clMaxImgPages>0){
           /* divide by max img size specified */
           total_imgs = total_pages_to_process/clMaxImgPages;
+          /* a run split to fit --mem-limit keeps the pages of the
+           * sections it split, the last image takes what is left */
+          if(mem_split&&!clShards)total_imgs = (mem_split+clMaxImgPages-1)/clMaxImgPages;
           thread_rounds = total_imgs/thread_cnt;
           pages_per_thread = clMaxImgPages;
           /* check if we have enough thread rounds for all data  */
@@ -465,114 +1899,279 @@ int main(int argc, char **argv){
 
      }else
      {   /* divide among max threads */
+          if(clShards)
+               abort_("--shard needs -x pages per image");
           pages_per_thread = total_pages_to_process/thread_cnt;
           total_imgs=thread_cnt;
+          thread_rounds=1;
+     }
+
+     /* a shard renders a contiguous share of the run's images. Every
+      * shard scans the whole run, so page numbers, damaged ranges and the
+      * temperature palette come out as in a single process run */
+     int image_base = 0;
+     if(clShards){
+          int first_img = (long long)clShard*total_imgs/clShards;
+          int last_img = (long long)(clShard+1)*total_imgs/clShards;
+          if(clVerbose)printf("Shard %d of %d: images %d-%d of %d\n", clShard, clShards, first_img, last_img-1, total_imgs);
+          image_base = first_img;
+          total_imgs = last_img-first_img;
+          thread_rounds = (total_imgs+thread_cnt-1)/thread_cnt;
+     }
+
+     /* pages of the last image and of the images together */
+     int last_pages = pages_per_thread;
+     if(mem_split&&!clShards&&total_imgs)last_pages = mem_split-(total_imgs-1)*pages_per_thread;
+     int run_pages = (total_imgs-1)*pages_per_thread+last_pages;
+
+     /* worker placement, slots are spread over nodes in order */
+     cpu_topology topo;
+     pthread_attr_t thread_attr[MAX_THREADS];
+     cpu_set_t slot_cpus[MAX_THREADS];
+     if(clAffinity){
+          read_topology(&topo);
+          if(clVerbose)printf("NUMA nodes: %d\n", topo.nodes);
+     }
+     for(i=0;i<thread_cnt;++i){
+          pthread_attr_init(&thread_attr[i]);
+          if(clAffinity){
+               worker_cpuset(&topo, clAffinity, i, thread_cnt, &slot_cpus[i]);
+               pthread_attr_setaffinity_np(&thread_attr[i], sizeof(cpu_set_t), &slot_cpus[i]);
+          }
      }
      
-     int thread_compensator = 0;
-     int cnt_img=0;
-     int page_offset = clOffset;
+     /* worker arenas, sized for the largest section. The arenas are not
+      * touched here, so their pages land on the node of the pinned slot
+      * that first writes them */
+     worker_arena arenas[MAX_THREADS];
+     for(i=0;i<thread_cnt;++i)
+          arena_create(&arenas[i], pages_per_thread, img_height, clHugePages);
+
+     /* per slot I/O, io_uring falls back to blocking I/O when unavailable */
+     worker_io slot_io[MAX_THREADS];
+     for(i=0;i<thread_cnt;++i){
+          memset(&slot_io[i], 0, sizeof(worker_io));
+          slot_io[i].ring.fd = -1;
+          slot_io[i].write_fd = -1;
+          slot_io[i].direct = clDirect;
+          if(clIoUring&&!ring_init(&slot_io[i].ring, IO_RING_ENTRIES)&&i==0)
+               fprintf(stderr, "io_uring unavailable, using blocking I/O\n");
+     }
+
+     /* O_DIRECT is not supported everywhere, tmpfs for one */
+     int directfd = -1;
+     if(clDirect&&!layout&&source.type==SOURCE_PLAIN){
+          directfd = open(filename, O_RDONLY|O_DIRECT);
+          if(directfd<0)
+               fprintf(stderr, "O_DIRECT unavailable for %s, using buffered reads\n", filename);
+     }
+
+     /* colors of every target, an overview replaces the target's
+      * section images */
+     int section_targets = 0;
+     if(clOverview>0)clRows = 0;
+     for(i=0;i<target_cnt;++i){
+          if(build_colormap(&targets[i].colormap, targets[i].colormap_name, targets[i].tempmap_name, clBrightness, error))
+               abort_("%s", error);
+          if(targets[i].overview_width>0)
+               overview_create(&targets[i].overview, targets[i].overview_width, targets[i].height,
+                               run_pages, clPool);
+          else
+               section_targets++;
+     }
+
+     /* rows mode writes all sections to one image, -x bounds the rows
+      * held in memory to threads * pages */
+     png_stream stream;
+     if(clRows){
+          char stream_name[128];
+          sprintf(stream_name, "%s_output_0.png", fileprepend);
+          png_stream_open(&stream, stream_name, clSinkFd>=0 ? &sink : NULL,
+                          img_height, run_pages);
+     }
+
+     int round, img;
+     int slot_started[MAX_THREADS];
      
      /* Thread Launcher */
-     for(j=0;j<total_imgs;){
+     for(round=0;round<thread_rounds;++round){
       
-          /* compensate for need for fewer threads during this thread round */
-          if(j+thread_cnt>total_imgs){
-               thread_compensator = thread_cnt-((j+thread_cnt)-total_imgs);
-               page_offset=clOffset+(pages_per_thread*j);
-               //thread_compensator = 0;
-          }else
-          {
-               thread_compensator = thread_cnt;
+          /* slots the round leaves idle rasterize column blocks of
+           * the round's images. The round's workers are the first
+           * slots, pinned or not */
+          int round_imgs = 0;
+          for(i=0;i<thread_cnt;++i){
+               img = clAffinity&&!clRows&&clSinkFd<0 ? i*thread_rounds+round : round*thread_cnt+i;
+               if(img<total_imgs)round_imgs++;
           }
+
           /* create and launch threads with the thread's assigned data */
           threads_started=0;
-          for(i=0;i<thread_compensator;++i){
+          for(i=0;i<thread_cnt;++i){
+
+               /* pinned slots take a contiguous run of images so each node
+                * reads its own region of the file. Streamed rows and --out
+                * images are written in order, so every round takes the next
+                * sections */
+               if(clAffinity&&!clRows&&clSinkFd<0)
+                    img = i*thread_rounds+round;
+               else
+                    img = round*thread_cnt+i;
+               if(img>=total_imgs)continue;
 
                ptr_tdata = &thread_data[i];
-               ptr_tdata->total_pages_to_process = pages_per_thread;  // total pages to process
+               ptr_tdata->total_pages_to_process = img==total_imgs-1 ? last_pages : pages_per_thread;  // total pages to process
+               ptr_tdata->image_pages = pages_per_thread;
                ptr_tdata->sonar_page_count = sonar_page_count;   // total page count in file 
-               ptr_tdata->sonar_page_offset = page_offset+(pages_per_thread*i); // page offset into file to start processing  
-               ptr_tdata->sonar_data_offset = sonar_data_offset+(ptr_tdata->sonar_page_offset*sonar_size);    // offset into file in bytes
+               ptr_tdata->sonar_page_offset = sonar_page_offset+(pages_per_thread*(image_base+img)); // page offset into file to start processing  
+               ptr_tdata->page_data = page_data_store_ptr+(ptr_tdata->sonar_page_offset-sonar_page_offset);
+               ptr_tdata->sonar_data_offset = ptr_tdata->page_data->offset;    // offset into file in bytes
                ptr_tdata->sonar_size = sonar_size;     // page sonar size
                ptr_tdata->sonar_offset = sonar_offset; // 2800*$sonar_size;
                ptr_tdata->total_pages_processed = total_pages_processed;   
                ptr_tdata->verbose = clVerbose;
-               ptr_tdata->thread = cnt_img++;
+               ptr_tdata->thread = img;
+               ptr_tdata->image = image_base+img;
                ptr_tdata->temprscan = temprscan;
                ptr_tdata->maxtempr = maxtemp;
                ptr_tdata->mintempr = mintemp;
-               ptr_tdata->page_data = page_data_store_ptr;
+               ptr_tdata->layout = layout;
+               ptr_tdata->arena = &arenas[i];
+               ptr_tdata->io = &slot_io[i];
+               ptr_tdata->directfd = directfd;
+               ptr_tdata->brightness = clBrightness;
+               ptr_tdata->autolevels = clAutoLevels;
+               ptr_tdata->level_low = clLevelLow;
+               ptr_tdata->level_high = clLevelHigh;
+               ptr_tdata->bottom = clBottom;
+               ptr_tdata->pages_before = ptr_tdata->page_data-page_data_store_ptr;
+               ptr_tdata->pages_after = total_pages_to_process-ptr_tdata->pages_before-ptr_tdata->total_pages_to_process;
+               ptr_tdata->filters = filters;
+               ptr_tdata->split = round_imgs ? thread_cnt/round_imgs : 1;
+               ptr_tdata->slot = i;
+               ptr_tdata->slot_step = round_imgs;
+               ptr_tdata->slot_arenas = arenas;
+               ptr_tdata->slot_cpus = clAffinity ? slot_cpus : NULL;
+               ptr_tdata->targets = targets;
+               ptr_tdata->target_cnt = target_cnt;
+               ptr_tdata->rows = clRows;
+               ptr_tdata->stream = &stream;
+               ptr_tdata->sink = clSinkFd>=0 ? &sink : NULL;
+               ptr_tdata->cache_dir = clCache;
+               ptr_tdata->cache_hits = &cache_hits;
+               ptr_tdata->slgfd = source.fd;
+               ptr_tdata->source = &source;
                ptr_tdata->slgfile = fp;
                ptr_tdata->inputfile = filename;
-               ptr_tdata->file_prepend = fileprepend;
-               threadret[i] = pthread_create(&threads[i], NULL, section_process_thread, ptr_tdata);
-               if(threadret[i]==0)threads_started++;
+               threadret[i] = pthread_create(&threads[i], &thread_attr[i], section_process_thread, ptr_tdata);
+               if(threadret[i]==0)
+                    slot_started[threads_started++] = i;
+               else
+                    /* no thread, the section renders here so its turn in
+                     * the row stream or the --out sink still comes and goes */
+                    section_process_thread(ptr_tdata);
 
                #ifdef DISPLAY_TESTDATA          
                printf("t %d\n",i);
                printf("sp cnt %d\n",ptr_tdata->sonar_page_count);
                printf("sp offset %d\n", ptr_tdata->sonar_page_offset);
-               printf("sp data offset %d\n", ptr_tdata->sonar_data_offset);
+               printf("sp data offset %lld\n", (long long)ptr_tdata->sonar_data_offset);
                #endif
           }
        
           /* wait for threads */
           for(i=0;i<threads_started;++i){
-               pthread_join(threads[i], NULL);
+               pthread_join(threads[slot_started[i]], NULL);
           }
       
-          j+=thread_cnt;
-          page_offset=pages_per_thread*j;
-      
      }
   
+     for(i=0;i<thread_cnt;++i){
+          pthread_attr_destroy(&thread_attr[i]);
+          io_drain_writes(&slot_io[i]);
+          ring_exit(&slot_io[i].ring);
+          free(slot_io[i].out.data);
+     }
+     if(directfd>=0)close(directfd);
+     if(clRows)png_stream_close(&stream);
+     for(i=0;i<target_cnt;++i){
+          if(targets[i].overview_width>0){
+               char overview_name[128];
+               snprintf(overview_name, sizeof(overview_name), "%s_overview.png", targets[i].prefix);
+               overview_write(&targets[i].overview, overview_name, clSinkFd>=0 ? &sink : NULL,
+                              &targets[i].colormap, clAutoLevels);
+          }
+     }
+     if(clSinkFd>=0){
+          close(clSinkFd);
+          pthread_mutex_destroy(&sink.mutex);
+          pthread_cond_destroy(&sink.turn);
+     }
+
+     if(clCache&&clVerbose)
+          printf("Cache: %d of %d images reused\n", cache_hits, total_imgs*section_targets);
+
+     if(clAutoLevels&&clVerbose)
+          printf("Echo levels: %d at %.1f%%  %d at %.1f%%\n",
+               histogram_level(targets[0].run_histogram, clLevelLow), clLevelLow,
+               histogram_level(targets[0].run_histogram, clLevelHigh), clLevelHigh);
+     for(i=0;i<thread_cnt;++i)
+          arena_destroy(&arenas[i]);
+     summary_free(&summary);
+
+     if(clStats){
+          struct rusage usage;
+          gettimeofday(&time_end, NULL);
+          getrusage(RUSAGE_SELF, &usage);
+          printf("\nElapsed: %.3f s   Pages: %d\n",
+               (time_end.tv_sec-time_start.tv_sec)+(time_end.tv_usec-time_start.tv_usec)/1e6,
+               run_pages);
+          printf("Page faults: %ld minor  %ld major   Max RSS: %ld KB\n",
+               usage.ru_minflt, usage.ru_majflt, usage.ru_maxrss);
+     }
+
+     /* page data CSV, the bottom series is filled in by the workers */
+     if(clOutputDataFile&&page_data_store_ptr){
+          for(i=image_base*pages_per_thread;i<image_base*pages_per_thread+run_pages;++i)
+               write_page_row(fpOutfile, &page_data_store_ptr[i], page_data_store_ptr[i].ordinal+sonar_page_offset, clBottom);
+     }
+
+     if(clShards)
+          write_manifest(fileprepend, clShard, clShards, filename, clOutputDataFile ? dataoutfile : NULL,
+                         page_data_store_ptr+image_base*pages_per_thread, sonar_page_offset+image_base*pages_per_thread,
+                         image_base, total_imgs, pages_per_thread);
+
      if(page_data_store_ptr)free(page_data_store_ptr);
+     if(channel_blocks)free(channel_blocks);
+     if(blockindex.blocks)free(blockindex.blocks);
+     source_close(&source);
      fclose(fp);
      if(clOutputDataFile)fclose(fpOutfile);
   
      return 0;
 } /* main */
+#endif /* SLG_LIBRARY */
 
 void* section_process_thread( void* ptr_data){
 
-     int i, j, k, x, y;
-     char filename[64] = {0};
-     char stemp[128] = {0};
-     FILE* fp;
-     FILE* fpOutfile;
-     int clOutputDataFile = 0;
+     int t;
      thread_section_data* td = (thread_section_data*) ptr_data;
   
      /* echo gram page stats & settings */
      int total_pages_to_process = td->total_pages_to_process;      // total pages to process
-     int sonar_page_count = td->sonar_page_count;                  // total page count in file 
-     int sonar_page_offset = td->sonar_page_offset;                // page offset into file to start processing  
-     int sonar_data_offset = td->sonar_data_offset;                // offset into file in bytes
-     int sonar_size = td->sonar_size;                              // page sonar size
-     int sonar_offset = td->sonar_offset;                          // 2800*$sonar_size;
-     int clVerbose = td->verbose;
-     int temprscan = td->temprscan;
-
-     float maxtemp=td->maxtempr;
-     float mintemp=td->mintempr;
-     float temprange = maxtemp-mintemp;
-     float tempfactor=1;
-     float lastgoodtemp;
-  
-     processed_page_data* page_data_store_ptr = td->page_data;
-     fp = td->slgfile;
-     page_data_store_ptr = page_data_store_ptr + sonar_page_offset;
 
      /* test data output */
 #ifdef DISPLAY_TESTDATA
+     int i;
+     processed_page_data* page_data_store_ptr = td->page_data;
+
      if(0)
      //if(td->thread==0)
      {
           for(i=0;i<total_pages_to_process;++i){
                printf("%d, %d, %d, %x, %2.2f, %07.2f, %f, %f, %f, %f\n",
                      page_data_store_ptr[i].ordinal,
-                     (i+sonar_page_offset),
+                     (i+td->sonar_page_offset),
                      i,
                      page_data_store_ptr[i].flags ,
                      page_data_store_ptr[i].temprf ,
@@ -589,38 +2188,10 @@ void* section_process_thread( void* ptr_data){
 
      //fp = fopen(td->inputfile, "rb");
 
-     int total_pages_processed;
      int total_pages_read=0;
-     int total_bytes;
-     /* image settings */
-     int brightness_compensation = -245;
-     int reduction_factor = 2;
-     float reduction_factors[]={20.0, 16.0, 8.0, 5.7, 4.0, 4.15, 3.15, (16/7), 2.0, 2.0};
-
-     /* add size of SLG File header for offset position */
-     sonar_data_offset += sizeof(file_header);
-
-     /* allocate mem for raw sonar page data */
-     void* pSonarInput = malloc(SONAR_SIZE * (total_pages_to_process+1));
-     if(!pSonarInput)
-          abort_("Failed to allocate memory for page data.");
-     
-     /* allocate mem for echogream image data */
-     void *pNewEchoData = malloc(((ECHO_GRAM_SIZE/reduction_factor)*sizeof(rgbcolor))*total_pages_to_process);
-     if(!pNewEchoData)
-          abort_("Failed to allocate memory for echo data.");
-
-     /* allocate mem for img row ptrs */
-     png_bytep *pImg_row_ptrs = malloc(sizeof(png_bytep) * ECHO_GRAM_SIZE);
-     if(!pImg_row_ptrs)
-          abort_("Failed to allocate memory for img row pointers.");
-  
-     /* Setup Array for image rows */
-     for(i=0;i<(ECHO_GRAM_SIZE/reduction_factor);i++){
-          pImg_row_ptrs[i] = pNewEchoData+(total_pages_to_process*sizeof(rgbcolor)*i);
-     }
 
-     memset(pNewEchoData, 200, total_pages_to_process*(ECHO_GRAM_SIZE/reduction_factor)*sizeof(rgbcolor));
+     /* raw pages live in the worker's arena */
+     void* pSonarInput = td->arena->pSonarInput;
 
      /* Calcualate total_pages_to_process */
      total_pages_read=0;
@@ -628,44 +2199,130 @@ void* section_process_thread( void* ptr_data){
      /* LOCK */
      // pthread_mutex_lock(&td_mutex); 
 
-     /* seek offset into SLG file page start */
-     fseek(fp, sonar_data_offset, SEEK_SET);
-     total_pages_read = fread(pSonarInput, SONAR_SIZE, total_pages_to_process, fp);
+     /* read section pages, SL2/SL3 blocks are gathered through the index.
+      * With io_uring the reads stay in flight while earlier pages render */
+     section_reader reader;
+     reader_start(&reader, td, pSonarInput, total_pages_to_process);
+     pSonarInput = reader.pages;
 
      // pthread_mutex_unlock(&td_mutex);
 
-     if(!total_pages_read){
-          printf("Error reading file - %i of %i total sonar pages read.", i, total_pages_to_process);
-          abort_("Error reading file");
+     /* a section that can't be read is left out rather than ending the run */
+     total_pages_read = total_pages_to_process;
+     size_t first_read = reader_wait(&reader, SONAR_SIZE);
+     if(first_read<SONAR_SIZE){
+          fprintf(stderr, "Error reading file - %lu of %lu section bytes read.\n",
+                  (unsigned long)first_read, (unsigned long)total_pages_to_process*SONAR_SIZE);
+          total_pages_read = 0;
+     }
+
+     /* bottoms of the neighbouring sections' pages at its edges, so the
+      * median runs across images as over one series */
+     if(td->bottom)
+          bottom_edges(td, total_pages_to_process);
+
+     /* the pages are read once and every target renders from them */
+     for(t=0;t<td->target_cnt;++t){
+          target_apply(td, &td->targets[t], t);
+          render_section(td, &reader, pSonarInput, total_pages_read);
+     }
+     reader_finish(&reader);
+
+     return NULL;
+}
+
+/* render a target's image of the section's pages. The first target
+ * renders while the pages arrive, later ones from the pages in memory */
+void render_section(thread_section_data *td, section_reader *reader, void *pSonarInput, int total_pages_read){
+
+     int i, x;
+     char filename[128] = {0};
+     char stemp[128] = {0};
+     FILE* fpOutfile;
+     int clOutputDataFile = 0;
+     int clVerbose = td->verbose;
+     int total_pages_to_process = td->total_pages_to_process;
+     int total_pages_processed;
+     processed_page_data* page_data_store_ptr = td->page_data;
+
+     /* image settings */
+     int img_height = td->height;
+     int img_width;
+     int autolevels = td->autolevels;
+     unsigned int histogram[AUTOLEVEL_BANDS][256];
+
+     /* image data and row pointers live in the worker's arena */
+     worker_arena *arena = td->arena;
+     void *pNewEchoData = arena->pNewEchoData;
+     png_bytep *pImg_row_ptrs = arena->pImg_row_ptrs;
+     column_info *columns = arena->columns;
+
+     /* pages are image columns, or image rows when streaming rows */
+     int line_step = td->rows ? img_height : 1;
+     int line_stride = td->rows ? 1 : total_pages_to_process;
+
+     if(autolevels)
+          memset(histogram, 0, sizeof(histogram));
+  
+     /* Setup Array for image rows */
+     if(td->rows){
+          for(i=0;i<total_pages_to_process;i++)
+               pImg_row_ptrs[i] = pNewEchoData+(img_height*sizeof(rgbcolor)*i);
+     }else
+     {
+          for(i=0;i<img_height;i++)
+               pImg_row_ptrs[i] = pNewEchoData+(total_pages_to_process*sizeof(rgbcolor)*i);
      }
-     if(clVerbose)
-          printf("%i Total Bytes\n",(total_pages_read*SONAR_SIZE));
 
-     latlon latlonConv;
      raw_sonar_page* pPageRaw = (raw_sonar_page*) pSonarInput;
      page_data* pPage;
-  
-     /* depth break */ 
-     int factor_offset;
+     int first_page = 0;
 
-     /* Calculate color pallete for Tempr */
-     rgbcolor palette[512];
-     int palette_num = 0;
-     create_palette(palette, 255);
-
-     /* temp precalc */
-     float palhold, palhold1, palhold2, palhold3;
-     tempfactor = (maxtemp-maxtemp)/255;
-     /* seek first valid temp */
-     for(i=0;i<total_pages_to_process;++i){
-          if(page_data_store_ptr[i].temprf>0){
-               palhold1 = page_data_store_ptr[i].temprf-mintemp;
-               break;
+     /* output file name */
+     sprintf(stemp, "_%d.png", td->image);
+     strcpy(filename, td->file_prepend);
+     strcat(filename, "_output");
+     strcat(filename, stemp);
+
+     /* section images are cached by a key over the section's pages and
+      * the settings, a hit skips rendering and encoding */
+     char cache_path[1024];
+     if(td->cache_dir&&!td->rows&&!td->overview&&total_pages_read){
+          total_pages_read = reader_wait(reader, (size_t)total_pages_to_process*SONAR_SIZE)/SONAR_SIZE;
+          snprintf(cache_path, sizeof(cache_path), "%s/%016llx.png", td->cache_dir,
+                   section_key(td, pSonarInput, total_pages_read));
+          if(cache_fetch(td, cache_path, filename)){
+               __sync_fetch_and_add(td->cache_hits, 1);
+               /* the data CSV still gets the bottom */
+               if(td->bottom){
+                    for(i=0;i<total_pages_read;++i)
+                         columns[i].bottom_raw = detect_bottom((unsigned char*) page_echo(&pPageRaw[i]), page_echo_len(&pPageRaw[i]));
+                    smooth_bottom(columns, total_pages_read,
+                                  total_pages_read==total_pages_to_process ? td->bottom_edges : NULL);
+                    for(x=0;x<total_pages_read;++x){
+                         if(columns[x].bottom>=0)
+                              page_data_store_ptr[x].bottom_depth =
+                                   columns[x].bottom*page_data_store_ptr[x].depth_limit_bottom/ECHO_GRAM_SIZE;
+                    }
+               }
+               return;
           }
      }
+  
+     /* colors and the per page temperature palette index are
+      * precalculated for the run */
+     colormap_lut *colormap = td->colormap;
+
+     /* cores the round leaves idle rasterize column blocks of the image */
+     if(td->split>1){
+          first_page = rasterize_blocks(td, reader, pSonarInput, total_pages_read, line_step, line_stride, histogram);
+          pPageRaw += first_page;
+     }
      
      /* process page loop */
-     for(i=0;i<total_pages_to_process;i++){
+     for(i=first_page;i<total_pages_read;i++){
+          /* page and the bytes the echo gram may run into past it */
+          if(reader_wait(reader, (size_t)(i+2)*SONAR_SIZE)<(size_t)(i+1)*SONAR_SIZE)break;
           pPage = (page_data*)pPageRaw;
 
           /* 2c11 and 6d14 temp   6d14 latlon */
@@ -715,102 +2372,14 @@ void* section_process_thread( void* ptr_data){
                }
           }
 
-
-          float dbreak = pPage->depth_limit_bottom;
-
-          /* determine depth break factor */
-          if(dbreak<10)factor_offset = 0;
-          if(dbreak<20&&dbreak>=10)factor_offset = 1;
-          if(dbreak<30&&dbreak>=20)factor_offset = 2;
-          if(dbreak<40&&dbreak>=30)factor_offset = 3;
-          if(dbreak<50&&dbreak>=40)factor_offset = 4;
-          if(dbreak<60&&dbreak>=50)factor_offset = 5;
-          if(dbreak<70&&dbreak>=60)factor_offset = 6;
-          if(dbreak<80&&dbreak>=70)factor_offset = 7;
-          if(dbreak<90&&dbreak>=80)factor_offset = 8;
-          if(dbreak>=90)factor_offset = 9;
-
-          /* setup for writing image to memory */
-          rgbcolor pixel;
-          unsigned int ImgDataOffset=0;
-          png_bytep *pRow = pImg_row_ptrs;
-      
-          rgbcolor *pImgdata = (rgbcolor*) pNewEchoData;
-          pImgdata+=i;
-          
-          char *pEchoData = (char*) pPageRaw;
-          pEchoData += offsetof(sonar_page, echo_data);
-
-          /* calc palette value
-           *  calc color pos in palette
-          */
-          if(page_data_store_ptr[i].temprf>0){
-               palhold1 = page_data_store_ptr[i].temprf-mintemp;
-          }
-      
-          palhold2 = palhold1/temprange;
-          palhold3 = 255*palhold2;
-      
 #ifdef DISPLAY_TESTDATA      
           if(td->thread==0)
-               printf("%d %f %f %d\n", i, palhold1, palhold2, (int)palhold3); 
+               printf("%d %f %d\n", i, page_data_store_ptr[i].temprf, page_data_store_ptr[i].palette); 
 #endif      
 
-          /* compensate start of echo gram for differing pageheader sizes */
-          if(theFlags==0x6d14||theFlags==0x6d04){
-               pEchoData+=20;
-          }
-          /* mov echo gram data */
-          float factor_apply = 1;
-          
-          /* apply single factor or from table */
-          if(1){
-               /* apply from factor array */
-               factor_apply = reduction_factors[factor_offset];
-          }else
-          {    /* apply from using single factor */
-               factor_apply = reduction_factor;
-          }
-      
-          for(j=0;j<(ECHO_GRAM_SIZE/factor_apply);j++){   
-               /* read pixel value from echo gram */
-               unsigned char coloravg;
-               unsigned char echopixel = *pEchoData; 
-
-               /* Calculate reduction by averaging pixels */
-               /*
-               for(k=-1;k<reduction_factor-1;k++){
-                    coloravg+= *(pEchoData+k);
-               }
-
-               /* Calculate brightness and contrast */
-               /* 
-               (1-brightnessPercent/100.)*(maxPixelValue - minPixelValue) + minPixelValue
-               (1-contrastPercent/100.)*(maxPixelValue - minPixelValue)
-               coloravg/=reduction_factor;
-               */
-               
-               unsigned char color = abs(echopixel+brightness_compensation);
-               pixel.red = color;
-               pixel.green = color;
-               pixel.blue = color;
-          
-               /* apply temp color to bottom of image */
-               if(j>(ECHO_GRAM_SIZE/factor_apply)-30)
-               {              
-                    pixel.red = palette[(int)palhold3].red;
-                    pixel.green = palette[(int)palhold3].green;
-                    pixel.blue = palette[(int)palhold3].blue;
-               }
-
-               /* write pixel of echo gram data to img */
-               *pImgdata = pixel; 
-               pImgdata+= total_pages_to_process; // next line  (column)     
-               pEchoData+=(int)factor_apply;
-          }
-
-          palette_num++;
-          if(palette_num>255)palette_num=0;
+          /* write the page's line of the image */
+          rasterize_page(td, pPageRaw, (rgbcolor*) pNewEchoData + i*line_step, line_stride,
+                         page_data_store_ptr[i].palette, &columns[i], histogram);
 
           pPageRaw++;
 
@@ -818,63 +2387,883 @@ void* section_process_thread( void* ptr_data){
 
      /* Completion Stats  */
      total_pages_processed = i;
+
+     /* filters over the finished image's echo values */
+     if(td->filters)
+          filter_image(td, (rgbcolor*) pNewEchoData, line_step, line_stride, total_pages_processed, histogram);
+
+     /* auto levels from the histograms built while rasterizing, applied
+      * to the image rather than a second pass over the raw pages */
+     if(autolevels){
+          unsigned char lut[AUTOLEVEL_BANDS][256];
+          colormap_lut *levels = colormap;
+          colormap_lut identity;
+
+          /* max pooling keeps the leveled value, the overview colors it */
+          if(td->raw_echo){
+               for(x=0;x<COLORMAP_SIZE;++x){
+                    identity.levels[x].red = identity.levels[x].green = identity.levels[x].blue = x;
+                    identity.temp[x] = identity.levels[x];
+               }
+               levels = &identity;
+          }
+          autolevel_luts(histogram, td->level_low, td->level_high, td->run_histogram, lut);
+          for(x=0;x<total_pages_processed;++x)
+               apply_levels(lut, (rgbcolor*) pNewEchoData + x*line_step, line_stride, &columns[x], levels);
+     }
+
      if(clVerbose){
+          printf("%i Total Bytes\n",(total_pages_processed*SONAR_SIZE));
           printf("%d Total Pages Processed\n",i);
      }
 
+     /* bottom line over the finished image and the per page bottom depth */
+     if(td->bottom){
+          smooth_bottom(columns, total_pages_processed,
+                        total_pages_processed==total_pages_to_process ? td->bottom_edges : NULL);
+          for(x=0;x<total_pages_processed;++x){
+               if(columns[x].bottom<0)continue;
+               page_data_store_ptr[x].bottom_depth =
+                    columns[x].bottom*page_data_store_ptr[x].depth_limit_bottom/ECHO_GRAM_SIZE;
+               draw_bottom((rgbcolor*) pNewEchoData + x*line_step, line_stride, &columns[x]);
+          }
+     }
+
+     /* pool the finished section into the overview columns */
+     if(td->overview){
+          overview_add(td->overview, td->thread*td->image_pages, (rgbcolor*) pNewEchoData,
+                       line_step, line_stride, total_pages_processed, columns);
+          return;
+     }
+
+     /* rows go to the shared stream in section order */
+     if(td->rows){
+          png_stream_rows(td->stream, td->thread, pImg_row_ptrs, total_pages_processed, total_pages_to_process);
+          return;
+     }
+     if(!total_pages_processed){
+          if(td->sink)sink_skip(td->sink, td->thread);
+          return;
+     }
+
+     /* reduced images are packed at the start of the image data */
+     img_width = total_pages_processed;
+     if(td->scale>1){
+          downsample_image((rgbcolor*) pNewEchoData, line_stride, &img_width, &img_height, td->scale);
+          for(i=0;i<img_height;i++)
+               pImg_row_ptrs[i] = pNewEchoData+(img_width*sizeof(rgbcolor)*i);
+     }
+
      /* Raw Image data for PNG write function */
      img_data_info img_data;
-     img_data.width = total_pages_processed;
-     img_data.height = (ECHO_GRAM_SIZE/reduction_factor);
+     img_data.width = img_width;
+     img_data.height = img_height;
      img_data.color_type = PNG_COLOR_TYPE_RGB;
      img_data.bit_depth = 8;
      img_data.row_pointers = pImg_row_ptrs;
-  
-     /* write file */
-     sprintf(stemp, "_%d.png", td->thread);
-     strcpy(filename, td->file_prepend);
-     strcat(filename, "_output");
-     strcat(filename, stemp);
+     img_data.level = td->level;
   
 #ifdef DISPLAY_TESTDATA   
      printf("\n-> %s\n", filename);
 #endif
 
      //pthread_mutex_lock(&td_mutex);
-     write_png_file(filename, pNewEchoData, img_data);
+     if(td->sink){
+          /* encoded in parallel, written in image order */
+          io_drain_writes(td->io);
+          td->io->out.size = 0;
+          write_png(NULL, &td->io->out, img_data);
+          sink_write_image(td->sink, td->thread, td->image, &td->io->out);
+     }else if(td->io->ring.fd>=0){
+          /* an image left from a cached run shares the cache's file */
+          if(td->cache_dir)unlink(filename);
+          write_png_async(td->io, filename, img_data);
+     }else{
+          if(td->cache_dir)unlink(filename);
+          write_png_file(filename, pNewEchoData, img_data);
+     }
+     if(td->cache_dir)
+          cache_store(td, cache_path, filename);
      //pthread_mutex_unlock(&td_mutex);
-
-     // Clean up    
-     free(pSonarInput);
-     free(pNewEchoData);
-     free(pImg_row_ptrs);
 }
 
-void abort_(const char * s, ...){
-     
-	va_list args;
-	va_start(args, s);
-	vfprintf(stderr, s, args);
-	fprintf(stderr, "\n");
-	va_end(args);
-	abort();
+/* the section's pages split into column blocks, the worker takes the
+ * first and helper threads the others. Blocks write their own columns
+ * of the image and read the page data and colors shared read only.
+ * A helper stands in for an idle slot: it runs on that slot's cpus and
+ * keeps its depth grid tables in that slot's arena, so --mem-limit's
+ * count of a table set per slot holds. Returns the pages rasterized,
+ * none when the section is too small */
+int rasterize_blocks(thread_section_data *td, section_reader *reader, void *pSonarInput, int count,
+                     int line_step, int line_stride, unsigned int histogram[][256]){
+
+     raster_block *blocks;
+     pthread_t threads[MAX_THREADS];
+     pthread_attr_t attr;
+     int started[MAX_THREADS];
+     int split = td->split, pages, k, band, v;
+
+     /* the whole section is read before the blocks start */
+     pages = reader_wait(reader, (size_t)(count+1)*SONAR_SIZE)/SONAR_SIZE;
+     if(pages>count)pages = count;
+     if(split>pages/SPLIT_MIN_PAGES)split = pages/SPLIT_MIN_PAGES;
+     if(split<2)return 0;
+
+     blocks = calloc(split, sizeof(raster_block));
+     if(!blocks)
+          abort_("Failed to allocate memory for column blocks.");
+     for(k=0;k<split;++k){
+          raster_block *block = &blocks[k];
+
+          /* depth grid tables are built as pages are seen, each helper
+           * in its idle slot's arena */
+          block->td = *td;
+          block->arena = *td->arena;
+          if(k>0)block->arena.resample = td->slot_arenas[td->slot+k*td->slot_step].resample;
+          block->td.arena = &block->arena;
+          block->pages = (raw_sonar_page*)pSonarInput;
+          block->first = (long long)pages*k/split;
+          block->last = (long long)pages*(k+1)/split;
+          block->pImgdata = (rgbcolor*)td->arena->pNewEchoData;
+          block->line_step = line_step;
+          block->line_stride = line_stride;
+          block->histogram = histogram;
+          if(k>0&&td->autolevels){
+               block->histogram = calloc(AUTOLEVEL_BANDS, sizeof(*block->histogram));
+               if(!block->histogram)
+                    abort_("Failed to allocate memory for column blocks.");
+          }
+     }
+
+     for(k=1;k<split;++k){
+          pthread_attr_init(&attr);
+          if(td->slot_cpus)
+               pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &td->slot_cpus[td->slot+k*td->slot_step]);
+          started[k] = !pthread_create(&threads[k], &attr, raster_block_thread, &blocks[k]);
+          pthread_attr_destroy(&attr);
+     }
+     raster_block_thread(&blocks[0]);
+
+     /* a helper that did not start has its block rasterized here */
+     for(k=1;k<split;++k){
+          if(started[k])
+               pthread_join(threads[k], NULL);
+          else
+               raster_block_thread(&blocks[k]);
+          if(td->autolevels){
+               for(band=0;band<AUTOLEVEL_BANDS;++band)
+                    for(v=0;v<256;++v)histogram[band][v] += blocks[k].histogram[band][v];
+               free(blocks[k].histogram);
+          }
+          td->slot_arenas[td->slot+k*td->slot_step].resample = blocks[k].arena.resample;
+     }
+     td->arena->resample = blocks[0].arena.resample;
+     free(blocks);
+     return pages;
 }
 
-void write_png_file(char* file_name, void *data, img_data_info img_data){
+void *raster_block_thread(void *ptr_data){
+
+     raster_block *block = (raster_block*)ptr_data;
+     thread_section_data *td = &block->td;
+     int i;
+
+     for(i=block->first;i<block->last;++i)
+          rasterize_page(td, &block->pages[i], block->pImgdata + (size_t)i*block->line_step, block->line_stride,
+                         td->page_data[i].palette, &td->arena->columns[i], block->histogram);
+     return NULL;
+}
+
+/* point the worker at a target's settings */
+void target_apply(thread_section_data *td, render_target *target, int index){
+
+     td->target = index;
+     td->file_prepend = target->prefix;
+     td->colormap = &target->colormap;
+     td->roi_top = target->roi_top;
+     td->roi_bottom = target->roi_bottom;
+     td->depth_scale = target->depth_scale;
+     td->height = target->height;
+     td->scale = target->scale;
+     td->level = target->level;
+     td->overview = target->overview_width>0 ? &target->overview : NULL;
+     td->raw_echo = td->overview&&target->overview.pool==POOL_MAX;
+     td->run_histogram = target->run_histogram;
+}
+
+/* a --target spec, key=value pairs separated by commas. Keys not given
+ * keep the command line's settings */
+void target_parse(render_target *target, render_target *base, char *spec){
+
+     char *copy = strdup(spec);
+     char *key, *value, *next;
+
+     if(!copy)
+          abort_("Failed to allocate memory for a target.");
+     *target = *base;
+     target->prefix = NULL;
+     for(key=copy;key&&*key;key=next){
+          next = strchr(key, ',');
+          if(next)*next++ = 0;
+          value = strchr(key, '=');
+          if(!value)
+               abort_("--target %s: %s needs a value", spec, key);
+          *value++ = 0;
+          if(!strcmp(key, "prefix"))
+               target->prefix = value;
+          else if(!strcmp(key, "colormap"))
+               target->colormap_name = value;
+          else if(!strcmp(key, "tempmap"))
+               target->tempmap_name = value;
+          else if(!strcmp(key, "roi")){
+               if(sscanf(value, "%f:%f", &target->roi_top, &target->roi_bottom)!=2||
+                  target->roi_top<0||target->roi_bottom<=target->roi_top)
+                    abort_("--target %s: roi needs top:bottom, top above bottom", spec);
+          }else if(!strcmp(key, "depth-scale")){
+               target->depth_scale = atof(value);
+               if(!(target->depth_scale>0))
+                    abort_("--target %s: depth-scale needs a depth per row above 0", spec);
+          }else if(!strcmp(key, "scale")){
+               target->scale = atoi(value);
+               if(target->scale<1)
+                    abort_("--target %s: scale needs a reduction of 1 or more", spec);
+          }else if(!strcmp(key, "level")){
+               target->level = atoi(value);
+               if(target->level<0||target->level>9)
+                    abort_("--target %s: level needs a zlib level 0-9", spec);
+          }else if(!strcmp(key, "overview")){
+               target->overview_width = atoi(value);
+          }else
+               abort_("--target %s: unknown key %s", spec, key);
+     }
+     if(!target->prefix)
+          abort_("--target %s needs a prefix", spec);
+}
+
+/* image rows of a target. A depth band is as high as the most rows any
+ * page has in it, plus the temperature strip. A depth grid runs to the
+ * band's bottom or the deepest page */
+int target_height(render_target *target, processed_page_data *pages, int count, int verbose){
+
+     int height = ECHO_GRAM_SIZE/REDUCTION_FACTOR;
+     int i;
+
+     if(target->depth_scale>0){
+          float grid_bottom = target->roi_bottom;
+          if(grid_bottom<=0){
+               for(i=0;i<count;++i){
+                    if(pages[i].depth_limit_bottom>grid_bottom)
+                         grid_bottom = pages[i].depth_limit_bottom;
+               }
+          }
+          if(grid_bottom<=target->roi_top)
+               abort_("No pages reach the depth grid");
+          height = (int)ceil((grid_bottom-target->roi_top)/target->depth_scale)+TEMP_STRIP_ROWS;
+          if(height>ECHO_GRAM_SIZE)
+               abort_("--depth-scale %g makes %d rows, at most %d", target->depth_scale, height, ECHO_GRAM_SIZE);
+          if(verbose)printf("Depth grid %.1f-%.1f at %g per row, %d image rows\n",
+                            target->roi_top, grid_bottom, target->depth_scale, height);
+     }else if(target->roi_bottom>0){
+          int first, rows, max_rows = 0;
+          for(i=0;i<count;++i){
+               rows = roi_rows(pages[i].depth_limit_bottom, target->roi_top, target->roi_bottom, &first);
+               if(rows>max_rows)max_rows = rows;
+          }
+          height = max_rows+TEMP_STRIP_ROWS;
+          if(height>ECHO_GRAM_SIZE/REDUCTION_FACTOR)
+               height = ECHO_GRAM_SIZE/REDUCTION_FACTOR;
+          if(verbose)printf("Depth band %.1f-%.1f, %d image rows\n", target->roi_top, target->roi_bottom, height);
+     }
+     return height;
+}
+
+/* box filter an image by n in both directions, the reduced image is
+ * packed from the start of img. An output pixel lies before all the
+ * input pixels of the pixels after it, so the filter runs in place */
+void downsample_image(rgbcolor *img, int stride, int *width, int *height, int n){
+
+     int w = (*width+n-1)/n;
+     int h = (*height+n-1)/n;
+     int x, y, i, j;
+
+     for(y=0;y<h;++y){
+          for(x=0;x<w;++x){
+               unsigned int r = 0, g = 0, b = 0, cnt = 0;
+               for(j=y*n;j<(y+1)*n&&j<*height;++j){
+                    rgbcolor *p = img+(size_t)j*stride+x*n;
+                    for(i=0;i<n&&x*n+i<*width;++i,++cnt){
+                         r += p[i].red;
+                         g += p[i].green;
+                         b += p[i].blue;
+                    }
+               }
+               img[(size_t)y*w+x].red = r/cnt;
+               img[(size_t)y*w+x].green = g/cnt;
+               img[(size_t)y*w+x].blue = b/cnt;
+          }
+     }
+     *width = w;
+     *height = h;
+}
+
+/* start of a page's echo gram */
+char* page_echo(raw_sonar_page *pPageRaw){
+
+     char *pEchoData = (char*) pPageRaw;
+     int theFlags = (((page_data*)pPageRaw)->flags)>>16;
+
+     pEchoData += offsetof(sonar_page, echo_data);
+
+     /* compensate start of echo gram for differing pageheader sizes */
+     if(theFlags==0x6d14||theFlags==0x6d04){
+          pEchoData+=20;
+     }
+     return pEchoData;
+}
+
+/* echo gram bytes inside the page, a full echo gram runs into the next
+ * page's header */
+int page_echo_len(raw_sonar_page *pPageRaw){
+
+     int len = SONAR_SIZE-(page_echo(pPageRaw)-(char*)pPageRaw);
+
+     return len<ECHO_GRAM_SIZE ? len : ECHO_GRAM_SIZE;
+}
+
+/* rasterize one page into a line of the image, pixels stride apart.
+ * Columns of the default orientation have a stride of the image width */
+void rasterize_page(thread_section_data *td, raw_sonar_page *pPageRaw, rgbcolor *pImgdata, int stride,
+                    int palette_index, column_info *column, unsigned int histogram[][256]){
+
+     int j, rows, strip, first = 0;
+     resample_table *table = NULL;
+     colormap_lut *colormap = td->colormap;
+     int autolevels = td->autolevels;
+     page_data *pPage = (page_data*)pPageRaw;
+
+     /* depth break */ 
+     float dbreak = pPage->depth_limit_bottom;
+
+     /* setup for writing image to memory */
+     rgbcolor pixel;
      
+     char *pEchoData = page_echo(pPageRaw);
+     /* mov echo gram data */
+     float factor_apply = page_factor(dbreak);
+ 
+     /* bottom from the echo gram already in memory */
+     column->step = (int)factor_apply;
+     column->bottom_raw = td->bottom ? detect_bottom((unsigned char*)pEchoData, page_echo_len(pPageRaw)) : -1;
+
+     /* the whole echo gram with the temp strip over its last rows, or
+      * the rows of the depth band or grid with the strip below them */
+     column->grid = 0;
+     if(td->depth_scale>0){
+          table = resample_lookup(td, dbreak);
+          strip = table->rows;
+          rows = strip+TEMP_STRIP_ROWS;
+          column->grid = dbreak/ECHO_GRAM_SIZE/td->depth_scale;
+          column->grid_offset = (0.5f*dbreak/ECHO_GRAM_SIZE-td->roi_top)/td->depth_scale;
+     }else if(td->roi_bottom>0){
+          rows = roi_rows(dbreak, td->roi_top, td->roi_bottom, &first);
+          if(rows>td->height-TEMP_STRIP_ROWS)rows = td->height-TEMP_STRIP_ROWS;
+          strip = rows;
+          rows += TEMP_STRIP_ROWS;
+          pEchoData += first*column->step;
+     }else
+     {
+          rows = (int)ceil(ECHO_GRAM_SIZE/factor_apply);
+          strip = (int)(ECHO_GRAM_SIZE/factor_apply-TEMP_STRIP_ROWS)+1;
+     }
+     column->first = first;
+
+     for(j=0;j<strip;j++){   
+          /* read pixel value from echo gram, on the depth grid
+           * blended between the two nearest samples */
+          unsigned char echopixel;
+          if(table){
+               unsigned char *pSample = (unsigned char*)pEchoData+table->index[j];
+               echopixel = (pSample[0]*(256-table->weight[j])+pSample[1]*table->weight[j])>>8;
+          }else
+          {
+               echopixel = *pEchoData;
+               pEchoData+=column->step;
+          }
+          /* brightness and color from the run's echo map */
+          pixel = colormap->echo[echopixel];
+
+          /* auto levels, filters and max pooling keep the echo value,
+           * levels, colors and the temp strip are applied once the image
+           * is done. The histogram counts the filtered value when filtering */
+          if(autolevels||td->filters||td->raw_echo){
+               pixel.red = pixel.green = pixel.blue = echopixel;
+               if(autolevels&&!td->filters){
+                    if(td->roi_bottom>0||table)
+                         histogram[j*AUTOLEVEL_BANDS/rows][echopixel]++;
+                    else
+                         histogram[(int)(j*factor_apply)*AUTOLEVEL_BANDS/ECHO_GRAM_SIZE][echopixel]++;
+               }
+          }
+
+          /* write pixel of echo gram data to img */
+          *pImgdata = pixel; 
+          pImgdata+= stride; // next line  (column)     
+     }
+
+     /* apply temp color to bottom of image */
+     pixel = colormap->temp[palette_index];
+     for(;j<rows;j++){
+          *pImgdata = pixel;
+          pImgdata+= stride;
+     }
+
+     column->rows = rows;
+     column->strip = strip;
+     column->palette = palette_index;
+
+     /* clear rows below the echo gram, the arena is not cleared between images */
+     pixel.red = pixel.green = pixel.blue = 200;
+     for(;j<td->height;j++){
+          *pImgdata = pixel;
+          pImgdata+= stride;
+     }
+}
+
+/* echo gram samples per image row for a page's depth range */
+float page_factor(float dbreak){
+
+     int factor_offset;
+
+     /* determine depth break factor */
+     if(dbreak<10)factor_offset = 0;
+     if(dbreak<20&&dbreak>=10)factor_offset = 1;
+     if(dbreak<30&&dbreak>=20)factor_offset = 2;
+     if(dbreak<40&&dbreak>=30)factor_offset = 3;
+     if(dbreak<50&&dbreak>=40)factor_offset = 4;
+     if(dbreak<60&&dbreak>=50)factor_offset = 5;
+     if(dbreak<70&&dbreak>=60)factor_offset = 6;
+     if(dbreak<80&&dbreak>=70)factor_offset = 7;
+     if(dbreak<90&&dbreak>=80)factor_offset = 8;
+     if(dbreak>=90)factor_offset = 9;
+
+     return reduction_factors[factor_offset];
+}
+
+/* the worker's depth grid table for a page depth range, built the first
+ * time the range is seen. Logs keep the same range for long stretches so
+ * a page is mostly a lookup and a gather */
+resample_table* resample_lookup(thread_section_data *td, float dbreak){
+
+     worker_arena *arena = td->arena;
+     resample_table *table;
+     unsigned int key;
+     int rows_max = arena->height-TEMP_STRIP_ROWS;
+     int y, k;
+
+     if(!arena->resample){
+          size_t table_size = sizeof(short)+sizeof(unsigned char);
+          char *p;
+          arena->resample = malloc(RESAMPLE_TABLES*(sizeof(resample_table)+table_size*rows_max));
+          if(!arena->resample)
+               abort_("Failed to allocate memory for depth grid tables.");
+          /* all the index arrays ahead of the byte weights, so every
+           * index array stays aligned for short whatever rows_max */
+          p = (char*)(arena->resample+RESAMPLE_TABLES);
+          for(k=0;k<RESAMPLE_TABLES;++k){
+               arena->resample[k].depth = 0;
+               arena->resample[k].index = (short*)p+(size_t)k*rows_max;
+               arena->resample[k].weight = (unsigned char*)((short*)p+(size_t)RESAMPLE_TABLES*rows_max)+(size_t)k*rows_max;
+          }
+     }
+
+     memcpy(&key, &dbreak, sizeof(key));
+     key += td->target;
+     table = &arena->resample[(key*2654435761u)>>26&(RESAMPLE_TABLES-1)];
+     if(table->depth==dbreak&&table->target==td->target&&dbreak>0)
+          return table;
+
+     /* rows down to the page's range or the band's bottom */
+     float bottom = td->roi_bottom>0&&td->roi_bottom<dbreak ? td->roi_bottom : dbreak;
+     int rows = dbreak>0 ? (int)ceil((bottom-td->roi_top)/td->depth_scale) : 0;
+     if(rows<0)rows = 0;
+     if(rows>td->height-TEMP_STRIP_ROWS)rows = td->height-TEMP_STRIP_ROWS;
+
+     /* row centers in samples, sample k centered at k+0.5 */
+     for(y=0;y<rows;++y){
+          float pos = (td->roi_top+(y+0.5f)*td->depth_scale)*ECHO_GRAM_SIZE/dbreak-0.5f;
+          if(pos<0)pos = 0;
+          if(pos>=ECHO_GRAM_SIZE-1){
+               table->index[y] = ECHO_GRAM_SIZE-2;
+               table->weight[y] = 255;
+          }else
+          {
+               table->index[y] = (int)pos;
+               table->weight[y] = (int)((pos-(int)pos)*256);
+          }
+     }
+     table->rows = rows;
+     table->depth = dbreak;
+     table->target = td->target;
+     return table;
+}
+
+/* echo gram rows of a page inside the depth band top to bottom, first
+ * gets the row of the band's top. A page spans 0 to dbreak over the
+ * echo gram and its rows are sampled every (int)factor bytes */
+int roi_rows(float dbreak, float top, float bottom, int *first){
+
+     int step, rows, last;
+
+     *first = 0;
+     if(!(dbreak>0))return 0;
+     step = (int)page_factor(dbreak);
+     rows = (int)ceil(ECHO_GRAM_SIZE/page_factor(dbreak));
+
+     /* row j holds the sample at byte j*step, depth j*step*dbreak/ECHO_GRAM_SIZE */
+     *first = (int)ceil(top*ECHO_GRAM_SIZE/dbreak/step);
+     last = (int)ceil(bottom*ECHO_GRAM_SIZE/dbreak/step);
+     if(last>rows)last = rows;
+     if(*first>last)*first = last;
+     return last-*first;
+}
+
+/* levels for each depth band of an image, the image histogram is merged
+ * into the run histogram without locking */
+void autolevel_luts(unsigned int histogram[][256], float low, float high, unsigned int *run_histogram, unsigned char lut[][256]){
+
+     unsigned int image_histogram[256];
+     unsigned int band_total;
+     int band, k;
+
+     memset(image_histogram, 0, sizeof(image_histogram));
+     for(band=0;band<AUTOLEVEL_BANDS;++band){
+          for(k=0;k<256;++k)image_histogram[k] += histogram[band][k];
+     }
+     for(band=0;band<AUTOLEVEL_BANDS;++band){
+          /* bands without echo data fall back to the whole image */
+          for(band_total=0,k=0;k<256;++k)band_total += histogram[band][k];
+          autolevel_lut(band_total ? histogram[band] : image_histogram, low, high, lut[band]);
+     }
+     for(k=0;k<256;++k){
+          if(image_histogram[k])
+               __sync_fetch_and_add(&run_histogram[k], image_histogram[k]);
+     }
+}
+
+/* apply the band levels to a page's line and paint its temp strip.
+ * Bands are depth bands, each page spans its own depth range, and the
+ * levels blend between neighbouring bands so band edges don't show */
+void apply_levels(unsigned char lut[][256], rgbcolor *pImgdata, int stride, column_info *column, colormap_lut *colormap){
+
+     int step = (AUTOLEVEL_BANDS<<16)/column->rows;
+     int pos = step/2-32768;
+     int y, w, band;
+
+     for(y=0;y<column->rows;++y,pos+=step){
+          if(y<column->strip){
+               w = 0;
+               band = 0;
+               if(pos>0){
+                    band = pos>>16;
+                    w = (pos>>8)&255;
+               }
+               if(band>=AUTOLEVEL_BANDS-1){
+                    band = AUTOLEVEL_BANDS-2;
+                    w = 256;
+               }
+               unsigned char color = (lut[band][pImgdata->red]*(256-w)+
+                                      lut[band+1][pImgdata->red]*w)>>8;
+               *pImgdata = colormap->levels[color];
+          }else
+          {
+               *pImgdata = colormap->temp[column->palette];
+          }
+          pImgdata+= stride;
+     }
+}
+
+/* two pixel bottom line on a page's line of the image */
+void draw_bottom(rgbcolor *pImgdata, int stride, column_info *column){
+
+     rgbcolor line = {255, 0, 0};
+     int y = column->grid>0 ? (int)floor(column->bottom*column->grid+column->grid_offset) :
+                              column->bottom/column->step-column->first;
+
+     if(column->bottom>=0&&y>=0&&y+1<column->strip){
+          pImgdata[y*stride] = line;
+          pImgdata[(y+1)*stride] = line;
+     }
+}
+
+/* echo filters over an image's pages, between rasterizing and colors.
+ * The echo values are gathered into a plane a page per column, rows
+ * past a page's echo gram repeating its last row, filtered there and
+ * written back colored, or counted for auto levels */
+void filter_image(thread_section_data *td, rgbcolor *pImgdata, int line_step, int line_stride,
+                  int width, unsigned int histogram[][256]){
+
+     filter_chain *fc = td->filters;
+     worker_arena *arena = td->arena;
+     column_info *columns = arena->columns;
+     processed_page_data *pages = td->page_data;
+     colormap_lut *colormap = td->colormap;
+     unsigned char *plane, *work, *swap, *row;
+     short *gain;
+     int height = 0, x, x1, y, k;
+
+     for(x=0;x<width;++x)
+          if(columns[x].strip>height)height = columns[x].strip;
+     if(!width||!height)return;
+
+     /* two planes and a gain table sized for the arena's largest image */
+     if(!arena->filter){
+          arena->filter = malloc(2*(size_t)arena->pages*arena->height+sizeof(short)*arena->height);
+          if(!arena->filter)
+               abort_("Failed to allocate memory for the filter planes.");
+     }
+     plane = arena->filter;
+     work = plane+(size_t)width*height;
+     gain = (short*)(arena->filter+2*(size_t)arena->pages*arena->height);
+
+     for(y=0;y<height;++y){
+          row = plane+(size_t)y*width;
+          for(x=0;x<width;++x){
+               if(y<columns[x].strip)
+                    row[x] = pImgdata[(size_t)x*line_step+(size_t)y*line_stride].red;
+               else
+                    row[x] = y ? (row-width)[x] : 0;
+          }
+     }
+
+     /* time varied gain, a table for each run of pages with one depth range */
+     if(fc->tvg_spread||fc->tvg_alpha){
+          for(x=0;x<width;x=x1){
+               for(x1=x+1;x1<width&&pages[x1].depth_limit_bottom==pages[x].depth_limit_bottom;++x1);
+               filter_gain(td, &columns[x], pages[x].depth_limit_bottom, gain, height);
+               for(y=0;y<height;++y)
+                    filter_add(plane+(size_t)y*width+x, x1-x, gain[y]);
+          }
+     }
+
+     if(fc->median){
+          filter_median(plane, work, width, height);
+          swap = plane;
+          plane = work;
+          work = swap;
+     }
+
+     for(k=0;k<fc->smooth;++k){
+          filter_smooth(plane, work, width, height);
+          swap = plane;
+          plane = work;
+          work = swap;
+     }
+
+     for(x=0;x<width;++x){
+          rgbcolor *pixel = pImgdata+(size_t)x*line_step;
+          float factor = page_factor(pages[x].depth_limit_bottom);
+          int rows = columns[x].rows;
+          unsigned char v;
+
+          for(y=0;y<columns[x].strip;++y,pixel+=line_stride){
+               v = plane[(size_t)y*width+x];
+               if(!td->autolevels&&!td->raw_echo){
+                    *pixel = colormap->echo[v];
+               }else
+               {
+                    pixel->red = pixel->green = pixel->blue = v;
+                    if(td->autolevels&&(td->roi_bottom>0||td->depth_scale>0))
+                         histogram[y*AUTOLEVEL_BANDS/rows][v]++;
+                    else if(td->autolevels)
+                         histogram[(int)(y*factor)*AUTOLEVEL_BANDS/ECHO_GRAM_SIZE][v]++;
+               }
+          }
+     }
+}
+
+/* gain in echo counts for each image row of a page's depth range,
+ * 20log style spreading and absorption at the row's middle depth */
+void filter_gain(thread_section_data *td, column_info *column, float dbreak, short *gain, int height){
+
+     filter_chain *fc = td->filters;
+     float depth, g;
+     int y;
+
+     for(y=0;y<height;++y){
+          if(column->grid>0)
+               depth = td->roi_top+(y+0.5f)*td->depth_scale;
+          else
+               depth = ((column->first+y)*column->step+0.5f*column->step)*dbreak/ECHO_GRAM_SIZE;
+          /* no gain taken away above one depth unit */
+          if(depth<1)depth = 1;
+          g = fc->tvg_spread*log10f(depth)+2*fc->tvg_alpha*depth;
+          if(g>255)g = 255;
+          if(g<-255)g = -255;
+          gain[y] = (short)lrintf(g);
+     }
+}
+
+/* saturating add of a gain to a run of echo values */
+void filter_add(unsigned char *p, int n, int gain){
+
+     int x = 0, v;
+
+#ifdef __SSE2__
+     __m128i g = _mm_set1_epi8((char)(gain<0 ? -gain : gain));
+     __m128i a;
+
+     for(;x+16<=n;x+=16){
+          a = _mm_loadu_si128((__m128i*)(p+x));
+          a = gain<0 ? _mm_subs_epu8(a, g) : _mm_adds_epu8(a, g);
+          _mm_storeu_si128((__m128i*)(p+x), a);
+     }
+#endif
+     for(;x<n;++x){
+          v = p[x]+gain;
+          p[x] = v<0 ? 0 : v>255 ? 255 : v;
+     }
+}
+
+/* median of a pixel's 3x3 neighbourhood, edges repeated */
+unsigned char median_pixel(unsigned char *r0, unsigned char *r1, unsigned char *r2, int x, int width){
+
+     int l = x>0 ? x-1 : 0;
+     int r = x<width-1 ? x+1 : x;
+     unsigned char p[9] = {r0[l], r0[x], r0[r], r1[l], r1[x], r1[r], r2[l], r2[x], r2[r]};
+     unsigned char t;
+
+     MEDIAN9(p, SORT_U8);
+     return p[4];
+}
+
+/* 3x3 median despeckle, sixteen pixels at a time through a min/max network */
+void filter_median(unsigned char *src, unsigned char *dst, int width, int height){
+
+     unsigned char *r0, *r1, *r2, *out;
      int x, y;
+
+     for(y=0;y<height;++y){
+          r0 = src+(size_t)(y>0 ? y-1 : 0)*width;
+          r1 = src+(size_t)y*width;
+          r2 = src+(size_t)(y<height-1 ? y+1 : y)*width;
+          out = dst+(size_t)y*width;
+
+          out[0] = median_pixel(r0, r1, r2, 0, width);
+          x = 1;
+#ifdef __SSE2__
+          for(;x+17<=width;x+=16){
+               __m128i p[9], t;
+               p[0] = _mm_loadu_si128((__m128i*)(r0+x-1));
+               p[1] = _mm_loadu_si128((__m128i*)(r0+x));
+               p[2] = _mm_loadu_si128((__m128i*)(r0+x+1));
+               p[3] = _mm_loadu_si128((__m128i*)(r1+x-1));
+               p[4] = _mm_loadu_si128((__m128i*)(r1+x));
+               p[5] = _mm_loadu_si128((__m128i*)(r1+x+1));
+               p[6] = _mm_loadu_si128((__m128i*)(r2+x-1));
+               p[7] = _mm_loadu_si128((__m128i*)(r2+x));
+               p[8] = _mm_loadu_si128((__m128i*)(r2+x+1));
+               MEDIAN9(p, SORT_SSE2);
+               _mm_storeu_si128((__m128i*)(out+x), p[4]);
+          }
+#endif
+          for(;x<width;++x)
+               out[x] = median_pixel(r0, r1, r2, x, width);
+     }
+}
+
+/* [1 2 1] across neighbouring pages, rounded as two averages so the
+ * scalar and SSE2 paths agree */
+void filter_smooth(unsigned char *src, unsigned char *dst, int width, int height){
+
+     unsigned char *in, *out;
+     int x, y, l, r;
+
+     for(y=0;y<height;++y){
+          in = src+(size_t)y*width;
+          out = dst+(size_t)y*width;
+
+          r = width>1 ? 1 : 0;
+          out[0] = (((in[0]+in[r]+1)>>1)+in[0]+1)>>1;
+          x = 1;
+#ifdef __SSE2__
+          for(;x+17<=width;x+=16){
+               __m128i a = _mm_loadu_si128((__m128i*)(in+x-1));
+               __m128i b = _mm_loadu_si128((__m128i*)(in+x));
+               __m128i c = _mm_loadu_si128((__m128i*)(in+x+1));
+               _mm_storeu_si128((__m128i*)(out+x), _mm_avg_epu8(_mm_avg_epu8(a, c), b));
+          }
+#endif
+          for(;x<width;++x){
+               l = x-1;
+               r = x<width-1 ? x+1 : x;
+               out[x] = (((in[l]+in[r]+1)>>1)+in[x]+1)>>1;
+          }
+     }
+}
+
+void abort_(const char * s, ...){
+     
+	va_list args;
+	va_start(args, s);
+	vfprintf(stderr, s, args);
+	fprintf(stderr, "\n");
+	va_end(args);
+	abort();
+}
+
+/* abort_'s message into error, ERROR_SIZE bytes. Returns -1 */
+int fail_(char *error, const char * s, ...){
+
+     va_list args;
+     va_start(args, s);
+     vsnprintf(error, ERROR_SIZE, s, args);
+     va_end(args);
+     return -1;
+}
+
+void write_png_file(char* file_name, void *data, img_data_info img_data){
+	  
+     /* create file */
+	FILE *fp=fopen(file_name, "wb");
+	if(!fp)
+		abort_("[write_png_file] File %s could not be opened for writing", file_name);
+
+     write_png(fp, NULL, img_data);
+
+     fclose(fp);
+}
+
+/* libpng write callbacks for encoding into memory */
+void png_buffer_write(png_structp png_ptr, png_bytep data, png_size_t length){
+
+     png_buffer *buf = (png_buffer*) png_get_io_ptr(png_ptr);
+
+     if(buf->size+length>buf->cap){
+          size_t cap = buf->cap ? buf->cap : 1024*1024;
+          char *grown;
+          while(cap<buf->size+length)cap*=2;
+          grown = realloc(buf->data, cap);
+          if(!grown)
+               abort_("Failed to allocate memory for png buffer.");
+          buf->data = grown;
+          buf->cap = cap;
+     }
+     memcpy(buf->data+buf->size, data, length);
+     buf->size += length;
+}
+
+void png_buffer_flush(png_structp png_ptr){
+}
+
+/* encode an image to fp, or to buf when fp is NULL */
+void write_png(FILE *fp, png_buffer *buf, img_data_info img_data){
+     
      int width, height;
      png_byte color_type;
      png_byte bit_depth;
      png_structp png_ptr;
      png_infop info_ptr;
-     int number_of_passes;
      png_bytep * row_pointers;
-	  
-     /* create file */
-	FILE *fp=fopen(file_name, "wb");
-	if(!fp)
-		abort_("[write_png_file] File %s could not be opened for writing", file_name);
 
 	/* initialize stuff */
 	png_ptr=png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
@@ -889,7 +3278,10 @@ void write_png_file(char* file_name, void *data, img_data_info img_data){
 	if(setjmp(png_jmpbuf(png_ptr)))
 		abort_("Failed Error during init_io");
 
-	png_init_io(png_ptr, fp);
+     if(fp)
+          png_init_io(png_ptr, fp);
+     else
+          png_set_write_fn(png_ptr, buf, png_buffer_write, png_buffer_flush);
 
 	/* write png header */
 	if(setjmp(png_jmpbuf(png_ptr)))
@@ -905,6 +3297,8 @@ void write_png_file(char* file_name, void *data, img_data_info img_data){
 	png_set_IHDR(png_ptr, info_ptr, width, height,
 		     bit_depth, color_type, PNG_INTERLACE_NONE,
 		     PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+     if(img_data.level>=0)
+          png_set_compression_level(png_ptr, img_data.level);
 
 	png_write_info(png_ptr, info_ptr);
 
@@ -919,86 +3313,2922 @@ void write_png_file(char* file_name, void *data, img_data_info img_data){
 
 	png_write_end(png_ptr, NULL);
 
-     fclose(fp);
+     png_destroy_write_struct(&png_ptr, &info_ptr);
 }
 
-int create_palette(rgbcolor palette[], int palette_colors){
-  
-     int i, j, k, l;
+/* shard manifest, the images the shard wrote and the pages behind them */
+void write_manifest(char *prepend, int shard, int shards, char *input, char *datafile,
+                    processed_page_data *pages, int page_base, int image_base, int images, int image_pages){
 
-     char rval = 255;
-     char gval = 255;
-     char bval = 0;
-     rgbcolor palhold[255];
+     char name[128];
+     FILE *fp;
+     int i;
 
-     /* create warm tempr colors */
-     j = 96;
-     for(i=0;i<127;i++){
-          j+=1;
-          if(j>192)j+=1;
-          palhold[i].red=rval;  //  Red
-          palhold[i].green=bval;     // Green
-          palhold[i].blue=j;  // Blue
-     }
-  
-     /* create cool tempr coolers */
-     j=255;
-     k=255;
-     l=0;
-     for(i=127;i<255;i++){
-          j-=2;
-          l+=2;
+     sprintf(name, "%s_shard_%d.txt", prepend, shard);
+     fp = fopen(name, "w");
+     if(!fp)
+          abort_("Shard manifest %s could not be opened for writing", name);
 
-          if(l>255)l=255;
-          if(l<0)l=0;
+     fprintf(fp, "slgtopngmt shard %d %d\n", shard, shards);
+     fprintf(fp, "input %s\n", input);
+     if(datafile)fprintf(fp, "data %s\n", datafile);
+     /* image, first page, pages, byte range of the pages, png */
+     for(i=0;i<images;++i){
+          processed_page_data *first = &pages[i*image_pages];
+          processed_page_data *last = &pages[(i+1)*image_pages-1];
+          fprintf(fp, "image %d %d %d %lld %lld %s_output_%d.png\n", image_base+i, page_base+i*image_pages,
+                  image_pages, (long long)first->offset, (long long)(last->offset+last->size), prepend, image_base+i);
+     }
+     fclose(fp);
+}
 
-          if(j>255)l=255;
-          if(j<0)l=0;
+/* combine the shard manifests of prepend into one manifest and the
+ * shard data files into datafile. Every image has to be there once */
+void merge_shards(char *prepend, char *datafile){
 
-          if(k>255)l=255;
-          if(k<0)l=0;
+     char name[128], line[1024], input[1024] = {0};
+     char buf[64*1024];
+     FILE *fp, *out, *in, *data = NULL;
+     int shard, shards = 1, s, n, image, next_image = 0;
+     long long first, stop, end = -1;
+     size_t len;
 
-          palhold[i].red=j;  //  Red
-          palhold[i].green=l;     // Green
-          palhold[i].blue=k;  // Blue
+     sprintf(name, "%s_manifest.txt", prepend);
+     out = fopen(name, "w");
+     if(!out)
+          abort_("Manifest %s could not be opened for writing", name);
+     if(datafile){
+          data = fopen(datafile, "w");
+          if(!data)
+               abort_("Data CSV File %s could not be opened for writing", datafile);
      }
-  
-  
-     /* reverse */
-     int c1=255;
-     for(i=0;i<255;i++){   
-          palette[i].red=palhold[c1].red;  //  Red
-          palette[i].green=palhold[c1].green;     // Green
-          palette[i].blue=palhold[c1].blue;  // Blue
-          c1--;
+
+     for(shard=0;shard<shards;++shard){
+          sprintf(name, "%s_shard_%d.txt", prepend, shard);
+          fp = fopen(name, "r");
+          if(!fp)
+               abort_("Shard manifest %s missing", name);
+          if(!fgets(line, sizeof(line), fp)||sscanf(line, "slgtopngmt shard %d %d", &s, &n)!=2||s!=shard)
+               abort_("Bad shard manifest %s", name);
+          if(!shard){
+               shards = n;
+               fprintf(out, "slgtopngmt shards %d\n", shards);
+          }else if(n!=shards)
+          {
+               abort_("Shard manifest %s is from a %d shard run", name, n);
+          }
+
+          while(fgets(line, sizeof(line), fp)){
+               line[strcspn(line, "\n")] = 0;
+
+               if(!strncmp(line, "input ", 6)){
+                    if(!shard){
+                         strcpy(input, line+6);
+                         fprintf(out, "%s\n", line);
+                    }else if(strcmp(input, line+6))
+                    {
+                         abort_("Shard %d renders %s, not %s", shard, line+6, input);
+                    }
+               }else if(!strncmp(line, "data ", 5))
+               {
+                    if(!data)continue;
+                    in = fopen(line+5, "rb");
+                    if(!in)
+                         abort_("Shard data %s missing", line+5);
+                    while((len = fread(buf, 1, sizeof(buf), in))>0)
+                         fwrite(buf, 1, len, data);
+                    fclose(in);
+               }else if(!strncmp(line, "image ", 6))
+               {
+                    if(sscanf(line, "image %d %*d %*d %lld %lld", &image, &first, &stop)!=3)
+                         abort_("Bad image in shard manifest %s", name);
+                    if(image!=next_image)
+                         abort_("Image %d missing before shard %d", next_image, shard);
+                    /* damaged logs can pull pages in from the next shard */
+                    if(first<end)
+                         fprintf(stderr, "Image %d overlaps the pages of the image before it\n", image);
+                    end = stop;
+                    next_image++;
+                    fprintf(out, "%s\n", line);
+               }
+          }
+          fclose(fp);
      }
-     /*
-     for(i=0;i<255;i++)
+
+     fclose(out);
+     if(data)fclose(data);
+     printf("Merged %d shards, %d images\n", shards, next_image);
+}
+
+/* a page's values as kept for the run */
+void page_record(processed_page_data *rec, page_data *page, int ordinal, off_t offset){
+
+     int flags = (page->flags)>>16;
+
+     memset(rec, 0, sizeof(processed_page_data));
+     rec->ordinal = ordinal;
+     rec->flags = flags;
+     if(flags==0x2c11||flags==0x6d14){
+          rec->temprc = page->tempr;
+          rec->temprf = (1.8*page->tempr)+32;
+     }else
      {
-          palette[i].red = color_grad[i*3];
-          palette[i].blue = color_grad[(i*3)+1];
-          palette[i].green = color_grad[(i*3)+2];
+          rec->temprc = -100;
+          rec->temprf = -100;
      }
-     */
+     if(flags==0x6d14){
+          rec->lat = latconvert(page->position_latitude);
+          rec->lon = lonconvert(page->position_longitude);
+     }
+     rec->depth_hard = page->depth_hard;
+     rec->depth_limit_bottom = page->depth_limit_bottom;
+     rec->offset = offset;
+     rec->size = SONAR_SIZE;
+     rec->bottom_depth = -1;
 }
 
-double latconvert( long lat_in){
-    
-     double lat = 0;
-     double pi = 3.1415926535898;
-     lat =  180/pi*(2*atan(exp((lat_in)/6356752.3142))-pi/2);
-        
-     return lat;
+/* temperature palette index per page, pages without a reading carry
+ * the last one and leading pages the first */
+void page_palettes(processed_page_data *pages, int count, float mintemp, float maxtemp){
+
+     float temprange = maxtemp-mintemp;
+     float palhold1 = 0;
+     int i;
+
+     for(i=0;i<count;++i){
+          if(pages[i].temprf>0){
+               palhold1 = pages[i].temprf-mintemp;
+               break;
+          }
+     }
+     for(i=0;i<count;++i){
+          if(pages[i].temprf>0)
+               palhold1 = pages[i].temprf-mintemp;
+          float palhold3 = temprange>0 ? 255*(palhold1/temprange) : 0;
+          pages[i].palette = palhold3<0 ? 0 : palhold3>255 ? 255 : (int)palhold3;
+     }
 }
 
-double lonconvert( long lon_in){
-     double lon = 0;
-     double pi = 3.1415926535898;
-     lon =  (180.0/pi);
-     lon = lon *(lon_in);
-     lon = lon/6356752.3142;
-         
-     return lon;
+/* a page's line of the data CSV */
+void write_page_row(FILE *fp, processed_page_data *pd, int page, int bottom){
+
+     fprintf(fp,"%#010x, %x, %f, %f, %f, %f, %f", page, pd->flags, pd->depth_limit_bottom,
+            pd->depth_hard, pd->temprf, pd->lat, pd->lon);
+     if(bottom)
+          fprintf(fp,", %f", pd->bottom_depth);
+     fprintf(fp,"\n");
+}
+
+/* streamed run
+ *
+ * Sections are read from the stream into the arena of the next worker
+ * slot and rendered while the following sections are read, a slot is
+ * waited on only when its turn comes round again. The temperature range
+ * isn't known ahead, each section's palette follows the range of the
+ * pages read so far unless temp_high>temp_low fixes it. A short last
+ * section is rendered as it is. Returns the pages read
+ */
+int stream_run(thread_section_data *base, stream_input *si, int thread_cnt, int pages_per_image, int first_page,
+               int page_limit, int hugepages, int iouring, float temp_low, float temp_high, FILE *csv){
+
+     thread_section_data thread_data[MAX_THREADS];
+     pthread_t threads[MAX_THREADS];
+     int busy[MAX_THREADS] = {0};     // 1 rendering, 2 rendered without a thread
+     worker_arena arenas[MAX_THREADS];
+     worker_io slot_io[MAX_THREADS];
+     processed_page_data *slot_pages[MAX_THREADS];
+     processed_page_data *pd;
+     raw_sonar_page *raw;
+     page_data page;
+     thread_section_data *td;
+     int fixed = temp_high>temp_low;
+     int have_range = fixed;
+     float mintemp = temp_low;
+     float maxtemp = temp_high;
+     float last_temp = 0;             // last reading, carried across sections
+     int i, k, n, slot, img = 0, pages = 0;
+     off_t pos;
+
+     for(i=0;i<thread_cnt;++i){
+          arena_create(&arenas[i], pages_per_image, base->height, hugepages);
+          memset(&slot_io[i], 0, sizeof(worker_io));
+          slot_io[i].ring.fd = -1;
+          slot_io[i].write_fd = -1;
+          if(iouring&&!ring_init(&slot_io[i].ring, IO_RING_ENTRIES)&&i==0)
+               fprintf(stderr, "io_uring unavailable, using blocking I/O\n");
+          slot_pages[i] = malloc(sizeof(processed_page_data)*pages_per_image);
+          if(!slot_pages[i])
+               abort_("Failed to allocate memory for page data.");
+     }
+
+     /* pages before the offset are read and dropped */
+     for(i=0;i<first_page;++i){
+          if(stream_next_page(si, arenas[0].pSonarInput, &page, i)<0)
+               abort_("Sonar Page offset past end of stream.");
+     }
+
+     for(;;){
+          slot = img%thread_cnt;
+          pd = slot_pages[slot];
+          raw = (raw_sonar_page*) arenas[slot].pSonarInput;
+
+          /* the slot's last section is done before its arena is refilled */
+          if(busy[slot]){
+               if(busy[slot]==1)pthread_join(threads[slot], NULL);
+               busy[slot] = 0;
+               if(csv){
+                    for(i=0;i<thread_data[slot].total_pages_to_process;++i)
+                         write_page_row(csv, &pd[i], pd[i].ordinal, base->bottom);
+               }
+          }
+
+          for(n=0;n<pages_per_image&&(page_limit<=0||pages<page_limit);++n){
+               pos = stream_next_page(si, &raw[n], &page, first_page+pages);
+               if(pos<0)break;
+               page_record(&pd[n], &page, first_page+pages, pos);
+               pages++;
+          }
+          if(!n)break;
+
+          /* temperature palette index per page, pages without a reading
+           * carry the last one and leading pages the first */
+          for(i=0;i<n;++i){
+               if(pd[i].temprf<=0)continue;
+               if(!last_temp)last_temp = pd[i].temprf;
+               if(fixed)continue;
+               if(!have_range||pd[i].temprf<mintemp)mintemp = pd[i].temprf;
+               if(!have_range||pd[i].temprf>maxtemp)maxtemp = pd[i].temprf;
+               have_range = 1;
+          }
+          for(i=0;i<n;++i){
+               if(pd[i].temprf>0)last_temp = pd[i].temprf;
+               float palhold1 = last_temp ? last_temp-mintemp : 0;
+               float palhold3 = maxtemp-mintemp>0 ? 255*(palhold1/(maxtemp-mintemp)) : 0;
+               pd[i].palette = palhold3<0 ? 0 : palhold3>255 ? 255 : (int)palhold3;
+          }
+
+          td = &thread_data[slot];
+          *td = *base;
+          td->total_pages_to_process = n;
+          td->sonar_page_offset = pd[0].ordinal;
+          td->sonar_data_offset = pd[0].offset;
+          td->page_data = pd;
+          td->thread = img;
+          td->image = img;
+          td->mintempr = mintemp;
+          td->maxtempr = maxtemp;
+          td->arena = &arenas[slot];
+          td->io = &slot_io[slot];
+          td->directfd = -1;
+          td->slgfd = -1;
+          td->streamed = 1;
+          busy[slot] = 1;
+          /* no thread, the section renders here in its turn of the sink */
+          if(pthread_create(&threads[slot], NULL, section_process_thread, td)){
+               section_process_thread(td);
+               busy[slot] = 2;
+          }
+          img++;
+          if(n<pages_per_image)break;
+     }
+
+     /* the sections still rendering, in image order */
+     for(k=0;k<thread_cnt;++k){
+          slot = (img+k)%thread_cnt;
+          if(!busy[slot])continue;
+          if(busy[slot]==1)pthread_join(threads[slot], NULL);
+          pd = slot_pages[slot];
+          if(csv){
+               for(i=0;i<thread_data[slot].total_pages_to_process;++i)
+                    write_page_row(csv, &pd[i], pd[i].ordinal, base->bottom);
+          }
+     }
+
+     if(base->verbose){
+          printf("Streamed %d pages in %d images\n", pages, img);
+          if(si->scan.resyncs)
+               printf("Resyncs: %d   Skipped bytes: %lld\n", si->scan.resyncs, (long long)si->scan.skipped);
+          if(!fixed&&have_range)
+               printf("Temperature range %.2f-%.2f F\n", mintemp, maxtemp);
+     }
+
+     for(i=0;i<thread_cnt;++i){
+          io_drain_writes(&slot_io[i]);
+          ring_exit(&slot_io[i].ring);
+          free(slot_io[i].out.data);
+          arena_destroy(&arenas[i]);
+          free(slot_pages[i]);
+     }
+     return pages;
+}
+
+/* write all of len to fd, pipes take writes in parts */
+void write_all(int fd, char *data, size_t len){
+
+     ssize_t n;
+
+     while(len>0){
+          n = write(fd, data, len);
+          if(n<0&&errno==EINTR)continue;
+          if(n<=0)
+               abort_("Error writing image output");
+          data += n;
+          len -= n;
+     }
+}
+
+/* write an encoded image once the images before it are out. A framed
+ * image is preceded by "SLGI", its image number (u32) and its length
+ * (u64), little endian */
+void sink_write_image(output_sink *sink, int seq, int image, png_buffer *buf){
+
+     unsigned char header[16];
+     unsigned long long len = buf->size;
+     int k;
+
+     pthread_mutex_lock(&sink->mutex);
+     while(sink->next!=seq)
+          pthread_cond_wait(&sink->turn, &sink->mutex);
+     pthread_mutex_unlock(&sink->mutex);
+
+     if(sink->framed){
+          memcpy(header, "SLGI", 4);
+          for(k=0;k<4;++k)header[4+k] = (unsigned)image>>(k*8);
+          for(k=0;k<8;++k)header[8+k] = len>>(k*8);
+          write_all(sink->fd, (char*)header, sizeof(header));
+     }
+     write_all(sink->fd, buf->data, buf->size);
+
+     sink_skip(sink, seq);
+}
+
+/* pass the turn on, also for sections that have no image */
+void sink_skip(output_sink *sink, int seq){
+
+     pthread_mutex_lock(&sink->mutex);
+     while(sink->next!=seq)
+          pthread_cond_wait(&sink->turn, &sink->mutex);
+     sink->next++;
+     pthread_cond_broadcast(&sink->turn);
+     pthread_mutex_unlock(&sink->mutex);
+}
+
+/* 64 bit hash over a block, eight bytes a step */
+unsigned long long hash64(unsigned long long h, void *data, size_t len){
+
+     unsigned char *p = (unsigned char*) data;
+     unsigned long long k;
+
+     while(len>=8){
+          memcpy(&k, p, 8);
+          k *= 0x87c37b91114253d5ULL;
+          k = (k<<31)|(k>>33);
+          h ^= k*0x4cf5ad432745937fULL;
+          h = ((h<<27)|(h>>37))*5+0x52dce729;
+          p += 8;
+          len -= 8;
+     }
+     while(len--){
+          h ^= *p++;
+          h *= 0x100000001b3ULL;
+     }
+     return h;
+}
+
+/* cache key of a section image: everything the pixels depend on, the
+ * pages, their palette indices and the run's render settings */
+unsigned long long section_key(thread_section_data *td, void *pSonarInput, int count){
+
+     unsigned long long h = CACHE_VERSION;
+     int settings[7];
+     float roi[3];
+     int i;
+
+     settings[0] = td->height;
+     settings[1] = td->autolevels;
+     settings[2] = td->autolevels ? (int)(td->level_low*1000) : 0;
+     settings[3] = td->autolevels ? (int)(td->level_high*1000) : 0;
+     settings[4] = td->bottom;
+     settings[5] = td->scale;
+     settings[6] = td->level;
+     h = hash64(h, settings, sizeof(settings));
+     roi[0] = td->roi_top;
+     roi[1] = td->roi_bottom;
+     roi[2] = td->depth_scale;
+     h = hash64(h, roi, sizeof(roi));
+     if(td->filters)
+          h = hash64(h, td->filters, sizeof(filter_chain));
+     h = hash64(h, reduction_factors, sizeof(reduction_factors));
+     h = hash64(h, td->colormap, sizeof(colormap_lut));
+     if(td->bottom)
+          h = hash64(h, td->bottom_edges, sizeof(td->bottom_edges));
+     for(i=0;i<count;++i)
+          h = hash64(h, &td->page_data[i].palette, sizeof(int));
+     h = hash64(h, &count, sizeof(count));
+     h = hash64(h, pSonarInput, (size_t)count*SONAR_SIZE);
+
+     /* finish so every input bit reaches every output bit */
+     h ^= h>>33;
+     h *= 0xff51afd7ed558ccdULL;
+     h ^= h>>33;
+     h *= 0xc4ceb9fe1a85ec53ULL;
+     h ^= h>>33;
+     return h;
+}
+
+/* copy a file, for when a hard link can't be made */
+int copy_file(char *from, char *to){
+
+     char buf[65536];
+     ssize_t n;
+     int in, out;
+
+     in = open(from, O_RDONLY);
+     if(in<0)return 0;
+     out = open(to, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+     if(out<0){
+          close(in);
+          return 0;
+     }
+     while((n = read(in, buf, sizeof(buf)))>0)
+          write_all(out, buf, n);
+     close(in);
+     close(out);
+     return n==0;
+}
+
+/* output a cached image, 0 when it isn't in the cache */
+int cache_fetch(thread_section_data *td, char *cache_path, char *filename){
+
+     struct stat st;
+     png_buffer *out = &td->io->out;
+     int fd;
+
+     if(td->sink){
+          fd = open(cache_path, O_RDONLY);
+          if(fd<0)return 0;
+          if(fstat(fd, &st)!=0||st.st_size==0){
+               close(fd);
+               return 0;
+          }
+          io_drain_writes(td->io);
+          if((size_t)st.st_size>out->cap){
+               char *grown = realloc(out->data, st.st_size);
+               if(!grown)
+                    abort_("Failed to allocate memory for png buffer.");
+               out->data = grown;
+               out->cap = st.st_size;
+          }
+          out->size = pread(fd, out->data, st.st_size, 0);
+          close(fd);
+          if(out->size!=(size_t)st.st_size)return 0;
+          sink_write_image(td->sink, td->thread, td->image, out);
+          return 1;
+     }
+
+     if(stat(cache_path, &st)!=0)return 0;
+     unlink(filename);
+     if(link(cache_path, filename)==0)return 1;
+     return copy_file(cache_path, filename);
+}
+
+/* add a written image to the cache. The image goes in under a temporary
+ * name and is renamed into place, so a run that stops half way or a
+ * second run sharing the cache never sees a partial image */
+void cache_store(thread_section_data *td, char *cache_path, char *filename){
+
+     char tmp[1100];
+     int fd, ok;
+
+     snprintf(tmp, sizeof(tmp), "%s.tmp.%d.%ld", cache_path, (int)getpid(), (long)syscall(SYS_gettid));
+     if(td->sink){
+          fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+          if(fd<0)return;
+          write_all(fd, td->io->out.data, td->io->out.size);
+          close(fd);
+          ok = 1;
+     }else{
+          /* async writes have to be on disk before the link */
+          if(td->io->ring.fd>=0)io_drain_writes(td->io);
+          ok = link(filename, tmp)==0||copy_file(filename, tmp);
+     }
+     if(!ok||rename(tmp, cache_path)!=0){
+          fprintf(stderr, "Could not add %s to the cache\n", filename);
+          unlink(tmp);
+     }
+}
+
+/* start an image that sections write rows to */
+void png_stream_open(png_stream *stream, char *file_name, output_sink *sink, int width, int height){
+
+     stream->fp = sink ? fdopen(dup(sink->fd), "wb") : fopen(file_name, "wb");
+     if(!stream->fp)
+          abort_("[png_stream_open] File %s could not be opened for writing", file_name);
+
+     stream->png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+     if(!stream->png_ptr)
+          abort_("Failed png_create_write_struct");
+
+     stream->info_ptr = png_create_info_struct(stream->png_ptr);
+     if(!stream->info_ptr)
+          abort_("Failed png_create_info_struct failed");
+
+     if(setjmp(png_jmpbuf(stream->png_ptr)))
+          abort_("[png_stream_open] Error during writing header");
+
+     png_init_io(stream->png_ptr, stream->fp);
+     png_set_IHDR(stream->png_ptr, stream->info_ptr, width, height,
+                  8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+                  PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+     png_write_info(stream->png_ptr, stream->info_ptr);
+
+     stream->fill = malloc(width*sizeof(rgbcolor));
+     if(!stream->fill)
+          abort_("Failed to allocate memory for png stream.");
+     memset(stream->fill, 200, width*sizeof(rgbcolor));
+
+     stream->next = 0;
+     pthread_mutex_init(&stream->mutex, NULL);
+     pthread_cond_init(&stream->turn, NULL);
+}
+
+/* write a section's rows once the sections before it are written.
+ * Pages the section could not read are written as blank rows */
+void png_stream_rows(png_stream *stream, int section, png_bytep *rows, int count, int total){
+
+     int i;
+
+     pthread_mutex_lock(&stream->mutex);
+     while(stream->next!=section)
+          pthread_cond_wait(&stream->turn, &stream->mutex);
+     pthread_mutex_unlock(&stream->mutex);
+
+     if(setjmp(png_jmpbuf(stream->png_ptr)))
+          abort_("Error during writing rows");
+
+     for(i=0;i<total;++i)
+          png_write_row(stream->png_ptr, i<count ? rows[i] : stream->fill);
+
+     pthread_mutex_lock(&stream->mutex);
+     stream->next++;
+     pthread_cond_broadcast(&stream->turn);
+     pthread_mutex_unlock(&stream->mutex);
+}
+
+void png_stream_close(png_stream *stream){
+
+     if(setjmp(png_jmpbuf(stream->png_ptr)))
+          abort_("Error during write png");
+
+     png_write_end(stream->png_ptr, NULL);
+     png_destroy_write_struct(&stream->png_ptr, &stream->info_ptr);
+     fclose(stream->fp);
+     free(stream->fill);
+     pthread_mutex_destroy(&stream->mutex);
+     pthread_cond_destroy(&stream->turn);
+}
+
+void overview_create(overview_image *ov, int width, int height, int pages, int pool){
+
+     /* no wider than the run */
+     if(width>pages)width = pages;
+     if(width<1)
+          abort_("No pages for the overview");
+
+     ov->width = width;
+     ov->height = height;
+     ov->pages = pages;
+     ov->pool = pool;
+     ov->acc = calloc((size_t)width*height*3, sizeof(unsigned int));
+     ov->count = calloc(width, sizeof(unsigned int));
+     if(!ov->acc||!ov->count)
+          abort_("Failed to allocate memory for overview.");
+}
+
+/* pool a section's page lines into the overview. Consecutive pages land
+ * in the same column, so a column is pooled locally and merged once.
+ * Only the columns shared with a neighbouring section see contention.
+ * Max pooling takes the strongest echo value before colors, or the
+ * highest temp strip palette index, so pooled colors are map colors */
+void overview_add(overview_image *ov, int first_page, rgbcolor *pImgdata, int line_step, int stride, int count,
+                  column_info *columns){
+
+     unsigned int line[ECHO_GRAM_SIZE*3];
+     int values = ov->height*3;
+     int col = -1, pooled = 0;
+     int p, y, k;
+
+     for(p=0;p<=count;++p){
+          int next = p<count ? (int)((long long)(first_page+p)*ov->width/ov->pages) : -1;
+
+          /* merge the finished column */
+          if(next!=col&&pooled){
+               unsigned int *acc = ov->acc+(size_t)col*values;
+               for(k=0;k<values;++k){
+                    if(ov->pool==POOL_MAX){
+                         unsigned int old = acc[k];
+                         while(line[k]>old){
+                              unsigned int seen = __sync_val_compare_and_swap(&acc[k], old, line[k]);
+                              if(seen==old)break;
+                              old = seen;
+                         }
+                    }else
+                    {
+                         __sync_fetch_and_add(&acc[k], line[k]);
+                    }
+               }
+               __sync_fetch_and_add(&ov->count[col], pooled);
+               pooled = 0;
+          }
+          if(p==count)break;
+          if(!pooled){
+               col = next;
+               memset(line, 0, values*sizeof(unsigned int));
+          }
+
+          rgbcolor *pixel = pImgdata+p*line_step;
+          if(ov->pool==POOL_MAX){
+               column_info *column = &columns[p];
+               unsigned int key;
+               for(y=0,k=0;y<ov->height;++y,pixel+=stride,k+=3){
+                    /* echo rows are grey until colored, but for the bottom line */
+                    if(y<column->strip&&pixel->green!=pixel->red)
+                         key = POOL_KEY_LINE;
+                    else if(y<column->strip)
+                         key = POOL_KEY_ECHO+pixel->red;
+                    else if(y<column->rows)
+                         key = POOL_KEY_STRIP+column->palette;
+                    else
+                         key = 0;
+                    if(key>line[k])line[k] = key;
+               }
+          }else
+          {
+               for(y=0,k=0;y<ov->height;++y,pixel+=stride,k+=3){
+                    line[k] += pixel->red;
+                    line[k+1] += pixel->green;
+                    line[k+2] += pixel->blue;
+               }
+          }
+          pooled++;
+     }
+}
+
+void overview_write(overview_image *ov, char *file_name, output_sink *sink, colormap_lut *colormap, int leveled){
+
+     int x, y, k;
+     rgbcolor *data = malloc((size_t)ov->width*ov->height*sizeof(rgbcolor));
+     png_bytep *rows = malloc(ov->height*sizeof(png_bytep));
+     if(!data||!rows)
+          abort_("Failed to allocate memory for overview.");
+
+     for(x=0;x<ov->width;++x){
+          unsigned int *acc = ov->acc+(size_t)x*ov->height*3;
+          unsigned int n = ov->count[x];
+          rgbcolor *pixel = data+x;
+
+          for(y=0,k=0;y<ov->height;++y,k+=3,pixel+=ov->width){
+               if(!n||(ov->pool==POOL_MAX&&acc[k]<POOL_KEY_STRIP)){
+                    pixel->red = pixel->green = pixel->blue = 200;
+               }else if(ov->pool==POOL_MAX&&acc[k]<POOL_KEY_ECHO){
+                    *pixel = colormap->temp[acc[k]-POOL_KEY_STRIP];
+               }else if(ov->pool==POOL_MAX&&acc[k]>=POOL_KEY_LINE){
+                    pixel->red = 255;
+                    pixel->green = pixel->blue = 0;
+               }else if(ov->pool==POOL_MAX){
+                    *pixel = leveled ? colormap->levels[acc[k]-POOL_KEY_ECHO] : colormap->echo[acc[k]-POOL_KEY_ECHO];
+               }else
+               {
+                    pixel->red = (acc[k]+n/2)/n;
+                    pixel->green = (acc[k+1]+n/2)/n;
+                    pixel->blue = (acc[k+2]+n/2)/n;
+               }
+          }
+     }
+     for(y=0;y<ov->height;++y)
+          rows[y] = (png_bytep)(data+(size_t)y*ov->width);
+
+     img_data_info img_data;
+     img_data.width = ov->width;
+     img_data.height = ov->height;
+     img_data.color_type = PNG_COLOR_TYPE_RGB;
+     img_data.bit_depth = 8;
+     img_data.row_pointers = rows;
+     img_data.level = -1;
+     if(sink){
+          png_buffer buf = {0};
+          write_png(NULL, &buf, img_data);
+          sink_write_image(sink, 0, 0, &buf);
+          free(buf.data);
+     }else
+          write_png_file(file_name, data, img_data);
+
+     free(rows);
+     free(data);
+     free(ov->acc);
+     free(ov->count);
+}
+
+/* allocate the levels of a summary tree for pages */
+void summary_alloc(summary_tree *tree, int pages){
+
+     size_t nodes = 0;
+     int l, size = pages;
+
+     tree->pages = pages;
+     tree->levels = 0;
+     do{
+          if(tree->levels==SUMMARY_MAX_LEVELS)
+               abort_("Too many pages for the summary tree.");
+          tree->level_size[tree->levels++] = size;
+          nodes += size;
+          size = (size+SUMMARY_FANOUT-1)/SUMMARY_FANOUT;
+     }while(tree->level_size[tree->levels-1]>1);
+
+     tree->data = malloc(sizeof(summary_stat)*SUMMARY_FIELDS*nodes);
+     if(!tree->data)
+          abort_("Failed to allocate memory for the summary tree.");
+     for(nodes=0,l=0;l<tree->levels;++l){
+          tree->level[l] = tree->data+nodes*SUMMARY_FIELDS;
+          nodes += tree->level_size[l];
+     }
+}
+
+/* fold b into a */
+void summary_merge(summary_stat *a, summary_stat *b){
+
+     if(!b->count)return;
+     if(!a->count||b->min<a->min)a->min = b->min;
+     if(!a->count||b->max>a->max)a->max = b->max;
+     a->sum += b->sum;
+     a->count += b->count;
 }
 
+/* pages at level 0, each level above pools the level below */
+void summary_build(summary_tree *tree, processed_page_data *pages, int count){
+
+     summary_stat *node;
+     float values[SUMMARY_FIELDS];
+     int i, l, f;
+
+     summary_alloc(tree, count);
+     for(i=0;i<count;++i){
+          values[SUMMARY_TEMP] = pages[i].temprf;
+          values[SUMMARY_DEPTH] = pages[i].depth_hard;
+          values[SUMMARY_LIMIT] = pages[i].depth_limit_bottom;
+          node = tree->level[0]+i*SUMMARY_FIELDS;
+          for(f=0;f<SUMMARY_FIELDS;++f){
+               node[f].min = node[f].max = node[f].sum = values[f];
+               node[f].count = 1;
+          }
+          /* only some page types carry a temperature */
+          if(pages[i].flags!=0x2c11&&pages[i].flags!=0x6d14){
+               memset(&node[SUMMARY_TEMP], 0, sizeof(summary_stat));
+          }
+     }
+     for(l=1;l<tree->levels;++l){
+          memset(tree->level[l], 0, sizeof(summary_stat)*SUMMARY_FIELDS*tree->level_size[l]);
+          for(i=0;i<tree->level_size[l-1];++i){
+               node = tree->level[l]+(i/SUMMARY_FANOUT)*SUMMARY_FIELDS;
+               for(f=0;f<SUMMARY_FIELDS;++f)
+                    summary_merge(&node[f], &tree->level[l-1][i*SUMMARY_FIELDS+f]);
+          }
+     }
+}
+
+/* stats over pages first to last. Unaligned nodes are taken at each end
+ * of the range and the rest moves up a level, so a query touches at most
+ * 2*SUMMARY_FANOUT nodes a level */
+void summary_query(summary_tree *tree, int first, int last, summary_stat *stats){
+
+     int a = first, b = last+1;
+     int l, f;
+
+     memset(stats, 0, sizeof(summary_stat)*SUMMARY_FIELDS);
+     for(l=0;l<tree->levels&&a<b;++l){
+          while(a<b&&(a%SUMMARY_FANOUT||a+SUMMARY_FANOUT>b||l==tree->levels-1)){
+               for(f=0;f<SUMMARY_FIELDS;++f)
+                    summary_merge(&stats[f], &tree->level[l][a*SUMMARY_FIELDS+f]);
+               a++;
+          }
+          while(a<b&&b%SUMMARY_FANOUT){
+               b--;
+               for(f=0;f<SUMMARY_FIELDS;++f)
+                    summary_merge(&stats[f], &tree->level[l][b*SUMMARY_FIELDS+f]);
+          }
+          a /= SUMMARY_FANOUT;
+          b /= SUMMARY_FANOUT;
+     }
+}
+
+/* the tree is written as is: magic, version, fields, fanout, pages and
+ * the levels' stats in host byte order */
+void summary_write(summary_tree *tree, char *file_name){
+
+     FILE *fp;
+     int header[4] = {SUMMARY_VERSION, SUMMARY_FIELDS, SUMMARY_FANOUT, tree->pages};
+     size_t nodes = 0;
+     int l;
+
+     for(l=0;l<tree->levels;++l)nodes += tree->level_size[l];
+     fp = fopen(file_name, "wb");
+     if(!fp)
+          abort_("Summary file %s could not be opened for writing", file_name);
+     if(fwrite(SUMMARY_MAGIC, 4, 1, fp)!=1||fwrite(header, sizeof(header), 1, fp)!=1||
+        fwrite(tree->data, sizeof(summary_stat)*SUMMARY_FIELDS, nodes, fp)!=nodes)
+          abort_("Error writing summary file %s", file_name);
+     fclose(fp);
+}
+
+void summary_read(summary_tree *tree, char *file_name){
+
+     FILE *fp;
+     char magic[4];
+     int header[4];
+     size_t nodes = 0;
+     int l;
+
+     fp = fopen(file_name, "rb");
+     if(!fp)
+          abort_("Summary file %s could not be opened for reading", file_name);
+     if(fread(magic, 4, 1, fp)!=1||memcmp(magic, SUMMARY_MAGIC, 4)||fread(header, sizeof(header), 1, fp)!=1||
+        header[0]!=SUMMARY_VERSION||header[1]!=SUMMARY_FIELDS||header[2]!=SUMMARY_FANOUT||header[3]<1)
+          abort_("%s is not a summary file of this version", file_name);
+     summary_alloc(tree, header[3]);
+     for(l=0;l<tree->levels;++l)nodes += tree->level_size[l];
+     if(fread(tree->data, sizeof(summary_stat)*SUMMARY_FIELDS, nodes, fp)!=nodes)
+          abort_("Summary file %s is short", file_name);
+     fclose(fp);
+}
+
+void summary_free(summary_tree *tree){
+     free(tree->data);
+     tree->data = NULL;
+}
+
+/* pages carrying a position, SLG 0x6d14 pages or SL2/SL3 blocks with a fix */
+int page_has_fix(processed_page_data *page){
+     return page->lat!=0||page->lon!=0;
+}
+
+/* grid cell of a position. A zero span, every fix on one latitude or
+ * longitude, is a single cell, and positions are clamped to the grid
+ * before the cast since out of range doubles don't convert to int */
+int gps_cell(gps_index *idx, double lat, double lon){
+
+     double lat_span = idx->max_lat-idx->min_lat;
+     double lon_span = idx->max_lon-idx->min_lon;
+     double fy = lat_span>0 ? (lat-idx->min_lat)/lat_span*idx->dim : 0;
+     double fx = lon_span>0 ? (lon-idx->min_lon)/lon_span*idx->dim : 0;
+     int y = fy>0 ? (fy<idx->dim ? (int)fy : idx->dim-1) : 0;
+     int x = fx>0 ? (fx<idx->dim ? (int)fx : idx->dim-1) : 0;
+
+     return y*idx->dim+x;
+}
+
+void gps_index_alloc(gps_index *idx){
+
+     idx->cell_start = calloc(idx->dim*idx->dim+1, sizeof(int));
+     idx->fix = malloc(sizeof(gps_fix)*(idx->fixes+1));
+     idx->order = malloc(sizeof(int)*(idx->fixes+1));
+     if(!idx->cell_start||!idx->fix||!idx->order)
+          abort_("Failed to allocate memory for the position index.");
+}
+
+/* fixes bucketed by grid cell with a counting sort */
+void gps_index_build(gps_index *idx, processed_page_data *pages, int count){
+
+     int i, n, cell;
+     int *fill;
+
+     memset(idx, 0, sizeof(gps_index));
+     idx->pages = count;
+     for(i=0;i<count;++i){
+          if(!page_has_fix(&pages[i]))continue;
+          if(!idx->fixes||pages[i].lat<idx->min_lat)idx->min_lat = pages[i].lat;
+          if(!idx->fixes||pages[i].lat>idx->max_lat)idx->max_lat = pages[i].lat;
+          if(!idx->fixes||pages[i].lon<idx->min_lon)idx->min_lon = pages[i].lon;
+          if(!idx->fixes||pages[i].lon>idx->max_lon)idx->max_lon = pages[i].lon;
+          idx->fixes++;
+     }
+     idx->dim = (int)sqrt(idx->fixes/GPS_CELL_FIXES);
+     if(idx->dim<1)idx->dim = 1;
+     if(idx->dim>GPS_GRID_MAX)idx->dim = GPS_GRID_MAX;
+     gps_index_alloc(idx);
+
+     for(i=0,n=0;i<count;++i){
+          if(!page_has_fix(&pages[i]))continue;
+          idx->cell_start[gps_cell(idx, pages[i].lat, pages[i].lon)+1]++;
+          idx->order[n++] = i;
+     }
+     for(i=0;i<idx->dim*idx->dim;++i)
+          idx->cell_start[i+1] += idx->cell_start[i];
+
+     fill = malloc(sizeof(int)*idx->dim*idx->dim);
+     if(!fill)
+          abort_("Failed to allocate memory for the position index.");
+     memcpy(fill, idx->cell_start, sizeof(int)*idx->dim*idx->dim);
+     for(n=0;n<idx->fixes;++n){
+          i = idx->order[n];
+          cell = gps_cell(idx, pages[i].lat, pages[i].lon);
+          idx->fix[fill[cell]].page = i;
+          idx->fix[fill[cell]].lat = pages[i].lat;
+          idx->fix[fill[cell]].lon = pages[i].lon;
+          fill[cell]++;
+     }
+     free(fill);
+}
+
+/* magic, version, pages, fixes, dim, the bounds, then the cell starts,
+ * fixes and page order in host byte order */
+void gps_index_write(gps_index *idx, char *file_name){
+
+     FILE *fp;
+     int header[4] = {GPS_VERSION, idx->pages, idx->fixes, idx->dim};
+     double bounds[4] = {idx->min_lat, idx->max_lat, idx->min_lon, idx->max_lon};
+     size_t cells = (size_t)idx->dim*idx->dim+1;
+
+     fp = fopen(file_name, "wb");
+     if(!fp)
+          abort_("Position index %s could not be opened for writing", file_name);
+     if(fwrite(GPS_MAGIC, 4, 1, fp)!=1||fwrite(header, sizeof(header), 1, fp)!=1||
+        fwrite(bounds, sizeof(bounds), 1, fp)!=1||
+        fwrite(idx->cell_start, sizeof(int), cells, fp)!=cells||
+        fwrite(idx->fix, sizeof(gps_fix), idx->fixes, fp)!=(size_t)idx->fixes||
+        fwrite(idx->order, sizeof(int), idx->fixes, fp)!=(size_t)idx->fixes)
+          abort_("Error writing position index %s", file_name);
+     fclose(fp);
+}
+
+void gps_index_read(gps_index *idx, char *file_name){
+
+     FILE *fp;
+     char magic[4];
+     int header[4];
+     double bounds[4];
+     size_t cells;
+
+     memset(idx, 0, sizeof(gps_index));
+     fp = fopen(file_name, "rb");
+     if(!fp)
+          abort_("Position index %s could not be opened for reading", file_name);
+     if(fread(magic, 4, 1, fp)!=1||memcmp(magic, GPS_MAGIC, 4)||fread(header, sizeof(header), 1, fp)!=1||
+        header[0]!=GPS_VERSION||header[2]<0||header[3]<1||header[3]>GPS_GRID_MAX||
+        fread(bounds, sizeof(bounds), 1, fp)!=1)
+          abort_("%s is not a position index of this version", file_name);
+     idx->pages = header[1];
+     idx->fixes = header[2];
+     idx->dim = header[3];
+     idx->min_lat = bounds[0];
+     idx->max_lat = bounds[1];
+     idx->min_lon = bounds[2];
+     idx->max_lon = bounds[3];
+     gps_index_alloc(idx);
+     cells = (size_t)idx->dim*idx->dim+1;
+     if(fread(idx->cell_start, sizeof(int), cells, fp)!=cells||
+        fread(idx->fix, sizeof(gps_fix), idx->fixes, fp)!=(size_t)idx->fixes||
+        fread(idx->order, sizeof(int), idx->fixes, fp)!=(size_t)idx->fixes)
+          abort_("Position index %s is short", file_name);
+     fclose(fp);
+}
+
+void gps_index_free(gps_index *idx){
+     free(idx->cell_start);
+     free(idx->fix);
+     free(idx->order);
+}
+
+/* lat,lon,lat,lon corners of a box, or lat,lon;lat,lon;... polygon corners */
+void gps_shape_parse(gps_shape *shape, char *box, char *polygon){
+
+     double lat0, lon0, lat1, lon1;
+     char *p;
+     int k, n;
+
+     memset(shape, 0, sizeof(gps_shape));
+     if(box){
+          if(sscanf(box, "%lf,%lf,%lf,%lf", &lat0, &lon0, &lat1, &lon1)!=4)
+               abort_("--bbox needs lat,lon,lat,lon");
+          shape->min_lat = lat0<lat1 ? lat0 : lat1;
+          shape->max_lat = lat0<lat1 ? lat1 : lat0;
+          shape->min_lon = lon0<lon1 ? lon0 : lon1;
+          shape->max_lon = lon0<lon1 ? lon1 : lon0;
+          return;
+     }
+
+     for(n=1,p=polygon;*p;++p)
+          if(*p==';')n++;
+     shape->lat = malloc(sizeof(double)*n);
+     shape->lon = malloc(sizeof(double)*n);
+     if(!shape->lat||!shape->lon)
+          abort_("Failed to allocate memory for the polygon.");
+     for(k=0,p=polygon;k<n;++k){
+          if(sscanf(p, "%lf,%lf", &shape->lat[k], &shape->lon[k])!=2)
+               abort_("--polygon needs lat,lon;lat,lon;lat,lon...");
+          if(!k||shape->lat[k]<shape->min_lat)shape->min_lat = shape->lat[k];
+          if(!k||shape->lat[k]>shape->max_lat)shape->max_lat = shape->lat[k];
+          if(!k||shape->lon[k]<shape->min_lon)shape->min_lon = shape->lon[k];
+          if(!k||shape->lon[k]>shape->max_lon)shape->max_lon = shape->lon[k];
+          p = strchr(p, ';');
+          if(p)p++;
+          else if(k<n-1)
+               abort_("--polygon needs lat,lon;lat,lon;lat,lon...");
+     }
+     if(n<3)
+          abort_("--polygon needs at least three corners");
+     shape->points = n;
+}
 
+/* box test, then crossings of a ray along lat for polygons */
+int gps_inside(gps_shape *shape, double lat, double lon){
+
+     int k, j, inside = 0;
+
+     if(lat<shape->min_lat||lat>shape->max_lat||lon<shape->min_lon||lon>shape->max_lon)
+          return 0;
+     if(!shape->points)
+          return 1;
+     for(k=0,j=shape->points-1;k<shape->points;j=k++){
+          if((shape->lat[k]>lat)!=(shape->lat[j]>lat)&&
+             lon<(shape->lon[j]-shape->lon[k])*(lat-shape->lat[k])/(shape->lat[j]-shape->lat[k])+shape->lon[k])
+               inside = !inside;
+     }
+     return inside;
+}
+
+int compare_int(const void *a, const void *b){
+     return *(int*)a-*(int*)b;
+}
+
+/* runs of pages inside the area as first,last pairs, the count returned.
+ * A page is at its last fix, pages before the first fix at the first.
+ * Only the cells the area's bounds overlap are visited */
+int gps_index_query(gps_index *idx, gps_shape *shape, int **runs){
+
+     int *hits, hit_cnt = 0, run_cnt = 0;
+     int y0, y1, x0, x1, x, y, k, h;
+     int lo, hi, first, last;
+
+     *runs = malloc(sizeof(int)*2*(idx->fixes+1));
+     hits = malloc(sizeof(int)*(idx->fixes+1));
+     if(!*runs||!hits)
+          abort_("Failed to allocate memory for the page runs.");
+     if(!idx->fixes||shape->max_lat<idx->min_lat||shape->min_lat>idx->max_lat||
+        shape->max_lon<idx->min_lon||shape->min_lon>idx->max_lon){
+          free(hits);
+          return 0;
+     }
+
+     y0 = gps_cell(idx, shape->min_lat, idx->min_lon)/idx->dim;
+     y1 = gps_cell(idx, shape->max_lat, idx->min_lon)/idx->dim;
+     x0 = gps_cell(idx, idx->min_lat, shape->min_lon);
+     x1 = gps_cell(idx, idx->min_lat, shape->max_lon);
+     for(y=y0;y<=y1;++y){
+          for(x=x0;x<=x1;++x){
+               for(k=idx->cell_start[y*idx->dim+x];k<idx->cell_start[y*idx->dim+x+1];++k){
+                    if(gps_inside(shape, idx->fix[k].lat, idx->fix[k].lon))
+                         hits[hit_cnt++] = idx->fix[k].page;
+               }
+          }
+     }
+     qsort(hits, hit_cnt, sizeof(int), compare_int);
+
+     for(h=0;h<hit_cnt;++h){
+          /* the page's position holds to the next fix */
+          lo = 0;
+          hi = idx->fixes;
+          while(lo<hi){
+               int mid = (lo+hi)/2;
+               if(idx->order[mid]<=hits[h])lo = mid+1;
+               else hi = mid;
+          }
+          first = hits[h]==idx->order[0] ? 0 : hits[h];
+          last = lo<idx->fixes ? idx->order[lo]-1 : idx->pages-1;
+          if(run_cnt&&first<=(*runs)[2*run_cnt-1]+1)
+               (*runs)[2*run_cnt-1] = last;
+          else{
+               (*runs)[2*run_cnt] = first;
+               (*runs)[2*run_cnt+1] = last;
+               run_cnt++;
+          }
+     }
+     free(hits);
+     return run_cnt;
+}
+
+void arena_create(worker_arena *arena, int pages, int height, int hugepages){
+
+     size_t offsets[3];
+     void *base = MAP_FAILED;
+
+     arena->size = arena_bytes(pages, height, offsets);
+     arena->huge = 0;
+
+#ifdef MAP_HUGETLB
+     if(hugepages){
+          size_t huge_size = (arena->size+HUGE_PAGE_SIZE-1)&~(size_t)(HUGE_PAGE_SIZE-1);
+          base = mmap(NULL, huge_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+          if(base!=MAP_FAILED){
+               arena->size = huge_size;
+               arena->huge = 1;
+          }
+     }
+#endif
+     if(base==MAP_FAILED){
+          base = mmap(NULL, arena->size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+          if(base==MAP_FAILED)
+               abort_("Failed to allocate memory for worker arena.");
+#ifdef MADV_HUGEPAGE
+          /* no reserved huge pages, ask for transparent ones */
+          if(hugepages)madvise(base, arena->size, MADV_HUGEPAGE);
+#endif
+     }
+
+     arena->base = base;
+     arena->pSonarInput = base;
+     arena->pNewEchoData = (char*)base+offsets[0];
+     arena->pImg_row_ptrs = (png_bytep*)((char*)base+offsets[1]);
+     arena->columns = (column_info*)((char*)base+offsets[2]);
+     arena->resample = NULL;
+     arena->filter = NULL;
+     arena->pages = pages;
+     arena->height = height;
+}
+
+/* bytes of an arena for sections of pages: the raw pages, the image,
+ * the row pointers and the columns. offsets, when not NULL, gets where
+ * the image, row pointers and columns start */
+size_t arena_bytes(int pages, int height, size_t *offsets){
+
+     /* room to align O_DIRECT reads on both ends */
+     size_t raw_size = (size_t)SONAR_SIZE*(pages+1)+2*IO_ALIGN;
+     size_t img_size = (size_t)height*sizeof(rgbcolor)*pages;
+     /* row pointers for either orientation */
+     size_t row_size = sizeof(png_bytep)*(pages>ECHO_GRAM_SIZE ? pages : ECHO_GRAM_SIZE);
+     size_t col_size = sizeof(column_info)*pages;
+
+     /* keep each buffer on its own cache line */
+     raw_size = (raw_size+63)&~(size_t)63;
+     img_size = (img_size+63)&~(size_t)63;
+     if(offsets){
+          offsets[0] = raw_size;
+          offsets[1] = raw_size+img_size;
+          offsets[2] = raw_size+img_size+row_size;
+     }
+     return raw_size+img_size+row_size+col_size;
+}
+
+/* memory a worker holds for a section: its arena, the encoder's zlib
+ * state and row buffers, the reader's chunk flags, the encoded image when
+ * images are encoded to memory (stored deflate blocks at worst, in a
+ * buffer that grows by doubling), the depth grid tables and the filter
+ * planes. Allocator overhead and thread stacks are not counted */
+size_t section_bytes(int pages, int height, int encoded, int resample, int filters){
+
+     size_t bytes = arena_bytes(pages, height, NULL);
+     size_t img = (size_t)height*(pages*sizeof(rgbcolor)+1);
+     size_t row = (size_t)(pages>height ? pages : height)*sizeof(rgbcolor)+1;
+
+     bytes += ENCODER_BYTES+2*row;
+     bytes += (size_t)SONAR_SIZE*(pages+1)/IO_CHUNK_SIZE+1;
+
+     if(encoded)bytes += 2*(img+img/1000+4096);
+     if(resample)bytes += RESAMPLE_TABLES*(sizeof(resample_table)+(sizeof(short)+1)*height);
+     if(filters)bytes += (2*(size_t)pages+sizeof(short))*height;
+     return bytes;
+}
+
+/* size with an optional K, M or G suffix */
+long long parse_size(char *str){
+
+     char *end;
+     double size = strtod(str, &end);
+
+     switch(*end){
+          case 'g': case 'G': size *= 1024;
+          case 'm': case 'M': size *= 1024;
+          case 'k': case 'K': size *= 1024;
+               end++;
+     }
+     if(end==str||*end)return -1;
+     return (long long)size;
+}
+
+void arena_destroy(worker_arena *arena){
+     if(arena->base)munmap(arena->base, arena->size);
+     arena->base = NULL;
+     free(arena->resample);
+     arena->resample = NULL;
+     free(arena->filter);
+     arena->filter = NULL;
+}
+
+/* parse a sysfs cpu list such as 0-3,8-11 */
+int parse_cpulist(char *list, cpu_set_t *set){
+
+     int first, last, cpu, cnt = 0;
+     char *p = list;
+
+     CPU_ZERO(set);
+     while(*p){
+          if(sscanf(p, "%d", &first)!=1)break;
+          last = first;
+          while(*p>='0'&&*p<='9')p++;
+          if(*p=='-'){
+               p++;
+               if(sscanf(p, "%d", &last)!=1)break;
+               while(*p>='0'&&*p<='9')p++;
+          }
+          for(cpu=first;cpu<=last&&cpu<CPU_SETSIZE;++cpu){
+               CPU_SET(cpu, set);
+               cnt++;
+          }
+          if(*p!=',')break;
+          p++;
+     }
+     return cnt;
+}
+
+void read_topology(cpu_topology *topo){
+
+     char path[128];
+     char list[1024];
+     int node;
+     FILE *fp;
+
+     topo->nodes = 0;
+     for(node=0;node<MAX_NODES;++node){
+          sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+          fp = fopen(path, "r");
+          if(!fp)continue;
+          if(fgets(list, sizeof(list), fp)){
+               topo->cpus[topo->nodes] = parse_cpulist(list, &topo->cpuset[topo->nodes]);
+               if(topo->cpus[topo->nodes]>0)topo->nodes++;
+          }
+          fclose(fp);
+     }
+
+     /* no NUMA info, one node with every cpu we may run on */
+     if(!topo->nodes){
+          sched_getaffinity(0, sizeof(cpu_set_t), &topo->cpuset[0]);
+          topo->cpus[0] = CPU_COUNT(&topo->cpuset[0]);
+          topo->nodes = 1;
+     }
+}
+
+/* cpus for a worker slot: slots fill nodes in order, core mode gives
+ * each slot of a node its own cpu of that node */
+void worker_cpuset(cpu_topology *topo, int mode, int slot, int slots, cpu_set_t *set){
+
+     int node = slot*topo->nodes/slots;
+     int first_slot = (node*slots+topo->nodes-1)/topo->nodes;
+     int k, cpu;
+
+     *set = topo->cpuset[node];
+     if(mode!=AFFINITY_CORE)return;
+
+     k = (slot-first_slot)%topo->cpus[node];
+     for(cpu=0;cpu<CPU_SETSIZE;++cpu){
+          if(CPU_ISSET(cpu, &topo->cpuset[node])&&k--==0)break;
+     }
+     CPU_ZERO(set);
+     CPU_SET(cpu, set);
+}
+
+/* strongest rising edge below the surface clutter, returns the sample
+ * where the edge rises or -1 when there is no clear return */
+int detect_bottom(unsigned char *echo, int len){
+
+     int start = BOTTOM_SKIP;
+     int end = len-BOTTOM_EDGE;
+     int best = 0;
+     int edge, j;
+
+#ifdef __SSE2__
+     unsigned char lanes[16];
+     __m128i vmax = _mm_setzero_si128();
+     __m128i a, b, e;
+     int mask;
+
+     for(j=start;j+16<=end;j+=16){
+          a = _mm_loadu_si128((__m128i*)(echo+j));
+          b = _mm_loadu_si128((__m128i*)(echo+j+BOTTOM_EDGE));
+          vmax = _mm_max_epu8(vmax, _mm_subs_epu8(b, a));
+     }
+     _mm_storeu_si128((__m128i*)lanes, vmax);
+     for(edge=0;edge<16;++edge)
+          if(lanes[edge]>best)best = lanes[edge];
+     for(;j<end;++j){
+          edge = echo[j+BOTTOM_EDGE]-echo[j];
+          if(edge>best)best = edge;
+     }
+     if(best<BOTTOM_MIN_EDGE)return -1;
+
+     /* first sample with the strongest edge */
+     e = _mm_set1_epi8((char)best);
+     for(j=start;j+16<=end;j+=16){
+          a = _mm_loadu_si128((__m128i*)(echo+j));
+          b = _mm_loadu_si128((__m128i*)(echo+j+BOTTOM_EDGE));
+          mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(b, a), e));
+          if(mask)return j+__builtin_ctz(mask)+BOTTOM_EDGE/2;
+     }
+     for(;j<end;++j){
+          if(echo[j+BOTTOM_EDGE]-echo[j]==best)return j+BOTTOM_EDGE/2;
+     }
+     return -1;
+#else
+     int found = -1;
+
+     for(j=start;j<end;++j){
+          edge = echo[j+BOTTOM_EDGE]-echo[j];
+          if(edge>best){
+               best = edge;
+               found = j+BOTTOM_EDGE/2;
+          }
+     }
+     return best<BOTTOM_MIN_EDGE ? -1 : found;
+#endif
+}
+
+/* median of the detected bottoms over neighbouring pages, pages without
+ * a return take the median of their neighbours. edges holds the raw
+ * bottoms of the BOTTOM_SMOOTH/2 pages before the section and of those
+ * after it, NULL when the window stops at the section's ends */
+void smooth_bottom(column_info *columns, int count, int *edges){
+
+     int window[BOTTOM_SMOOTH];
+     int half = BOTTOM_SMOOTH/2;
+     int i, j, k, n, v;
+
+     for(i=0;i<count;++i){
+          n = 0;
+          for(j=i-half;j<=i+half;++j){
+               if(j<0||j>=count)
+                    v = !edges ? -1 : j<0 ? edges[half+j] : edges[half+j-count];
+               else
+                    v = columns[j].bottom_raw;
+               if(v<0)continue;
+               /* insertion sort into the window */
+               for(k=n;k>0&&window[k-1]>v;--k)window[k] = window[k-1];
+               window[k] = v;
+               n++;
+          }
+          columns[i].bottom = n ? window[n/2] : -1;
+     }
+}
+
+/* raw bottoms of the pages either side of a section of count pages,
+ * read from the log. Pages outside the run, or that can't be read,
+ * are -1 */
+void bottom_edges(thread_section_data *td, int count){
+
+     thread_section_data edge = *td;
+     raw_sonar_page page;
+     int half = BOTTOM_SMOOTH/2;
+     int k, j;
+
+     for(k=0;k<2*half;++k){
+          j = k<half ? k-half : count+k-half;
+          td->bottom_edges[k] = -1;
+          if(j<-td->pages_before||j>=count+td->pages_after)continue;
+          edge.page_data = td->page_data+j;
+          if(read_section_pages(&edge, &page, 1)<1)continue;
+          td->bottom_edges[k] = detect_bottom((unsigned char*) page_echo(&page), page_echo_len(&page));
+     }
+}
+
+/* echo value at a percentile of the histogram */
+int histogram_level(unsigned int *histogram, float percent){
+
+     unsigned long long total = 0, sum = 0, want;
+     int i;
+
+     for(i=0;i<256;++i)total += histogram[i];
+     want = total*percent/100;
+     for(i=0;i<256;++i){
+          sum += histogram[i];
+          if(sum>want)break;
+     }
+     return i>255 ? 255 : i;
+}
+
+/* stretch the low..high percentile range over the gray scale, inverted
+ * like the brightness compensated output so strong returns stay dark */
+void autolevel_lut(unsigned int *histogram, float low, float high, unsigned char *lut){
+
+     int lo = histogram_level(histogram, low);
+     int hi = histogram_level(histogram, high);
+     int i, v;
+
+     if(hi<=lo)hi = lo+1;
+     for(i=0;i<256;++i){
+          v = (i-lo)*255/(hi-lo);
+          if(v<0)v = 0;
+          if(v>255)v = 255;
+          lut[i] = 255-v;
+     }
+}
+
+int create_palette(rgbcolor palette[], int palette_colors){
+  
+     int i, j, k, l;
+
+     char rval = 255;
+     char gval = 255;
+     char bval = 0;
+     rgbcolor palhold[256];
+
+     /* create warm tempr colors */
+     j = 96;
+     for(i=0;i<127;i++){
+          j+=1;
+          if(j>192)j+=1;
+          palhold[i].red=rval;  //  Red
+          palhold[i].green=bval;     // Green
+          palhold[i].blue=j;  // Blue
+     }
+  
+     /* create cool tempr coolers */
+     j=255;
+     k=255;
+     l=0;
+     for(i=127;i<255;i++){
+          j-=2;
+          l+=2;
+
+          if(l>255)l=255;
+          if(l<0)l=0;
+
+          if(j>255)l=255;
+          if(j<0)l=0;
+
+          if(k>255)l=255;
+          if(k<0)l=0;
+
+          palhold[i].red=j;  //  Red
+          palhold[i].green=l;     // Green
+          palhold[i].blue=k;  // Blue
+     }
+     palhold[255] = palhold[254];
+  
+  
+     /* reverse */
+     int c1=255;
+     for(i=0;i<255;i++){   
+          palette[i].red=palhold[c1].red;  //  Red
+          palette[i].green=palhold[c1].green;     // Green
+          palette[i].blue=palhold[c1].blue;  // Blue
+          c1--;
+     }
+     palette[255] = palette[254];
+     /*
+     for(i=0;i<255;i++)
+     {
+          palette[i].red = color_grad[i*3];
+          palette[i].blue = color_grad[(i*3)+1];
+          palette[i].green = color_grad[(i*3)+2];
+     }
+     */
+}
+
+/* colormap by name, or from a file of "r g b" lines. Maps with fewer
+ * than 256 entries are stretched over the echo range. Returns -1 with
+ * the reason in error when the file can't be used */
+int load_colormap(char *name, rgbcolor map[], char *error){
+
+     unsigned char entries[COLORMAP_SIZE][3];
+     int count = 0;
+     int i, k;
+
+     if(!strcmp(name, "grey")){
+          for(i=0;i<COLORMAP_SIZE;++i)
+               map[i].red = map[i].green = map[i].blue = i;
+          return 0;
+     }
+     if(!strcmp(name, "temp")){
+          create_palette(map, 255);
+          return 0;
+     }
+     if(!strcmp(name, "grad")){
+          /* color_grad is stored in png byte order */
+          for(count=0;count<COLORMAP_SIZE&&count*3<sizeof(color_grad);++count){
+               for(k=0;k<3;++k)
+                    entries[count][k] = (unsigned char) color_grad[count*3+k];
+          }
+     }else
+     {
+          char line[256];
+          int r, g, b;
+          FILE *fp = fopen(name, "r");
+          if(!fp)
+               return fail_(error, "Colormap %s could not be opened for reading", name);
+          while(count<COLORMAP_SIZE&&fgets(line, sizeof(line), fp)){
+               if(line[0]=='#')continue;
+               if(sscanf(line, "%d %d %d", &r, &g, &b)!=3)continue;
+               entries[count][0] = r<0 ? 0 : r>255 ? 255 : r;
+               entries[count][1] = g<0 ? 0 : g>255 ? 255 : g;
+               entries[count][2] = b<0 ? 0 : b>255 ? 255 : b;
+               count++;
+          }
+          fclose(fp);
+     }
+     if(count<2)
+          return fail_(error, "Colormap %s needs at least 2 colors", name);
+
+     /* stretch to the full map, fields are in png byte order */
+     for(i=0;i<COLORMAP_SIZE;++i){
+          int pos = i*(count-1)*256/(COLORMAP_SIZE-1);
+          int e = pos>>8, w = pos&255;
+          unsigned char rgb[3];
+          if(e>=count-1){
+               e = count-2;
+               w = 256;
+          }
+          for(k=0;k<3;++k)
+               rgb[k] = (entries[e][k]*(256-w)+entries[e+1][k]*w+128)>>8;
+          map[i].red = rgb[0];
+          map[i].blue = rgb[1];
+          map[i].green = rgb[2];
+     }
+     return 0;
+}
+
+/* lookups for the run. Brightness is folded into the echo map so a
+ * pixel is a single lookup, auto levels map through the plain colormap */
+int build_colormap(colormap_lut *colormap, char *echo_map, char *temp_map, int brightness, char *error){
+
+     int i;
+
+     if(load_colormap(echo_map, colormap->levels, error)||load_colormap(temp_map, colormap->temp, error))
+          return -1;
+     for(i=0;i<COLORMAP_SIZE;++i)
+          colormap->echo[i] = colormap->levels[(unsigned char)abs(i+brightness)];
+     return 0;
+}
+
+double latconvert( long lat_in){
+    
+     double lat = 0;
+     double pi = 3.1415926535898;
+     lat =  180/pi*(2*atan(exp((lat_in)/6356752.3142))-pi/2);
+        
+     return lat;
+}
+
+double lonconvert( long lon_in){
+     double lon = 0;
+     double pi = 3.1415926535898;
+     lon =  (180.0/pi);
+     lon = lon *(lon_in);
+     lon = lon/6356752.3142;
+         
+     return lon;
+}
+
+
+/* Input sources
+ *
+ * Logs can be read compressed when they are cut into independently
+ * compressed frames: blocked gzip as written by bgzip, or seekable zstd
+ * with its seek table. The frame index is built when the log is opened
+ * and a read decompresses only the frames it covers, so workers read
+ * their own page ranges as with a plain log. Frames that lie whole inside
+ * a read are decompressed straight into the caller's buffer.
+ *
+ * Opening a source returns -1 with the reason in error rather than
+ * ending the process, the Python module raises it.
+ */
+int source_add_frame(slg_source *src, off_t coffset, unsigned csize, unsigned usize, char *error){
+
+     source_frame *fr;
+
+     if(!(src->frame_count&1023)){
+          fr = realloc(src->frames, sizeof(source_frame)*(src->frame_count+1024));
+          if(!fr)
+               return fail_(error, "Failed to allocate memory for frame index.");
+          src->frames = fr;
+     }
+     fr = &src->frames[src->frame_count++];
+     fr->coffset = coffset;
+     fr->csize = csize;
+     fr->uoffset = src->size;
+     fr->usize = usize;
+     src->size += usize;
+     return 0;
+}
+
+/* walk the gzip members, BSIZE is in the BC extra field and the
+ * uncompressed size in the member trailer */
+int source_index_bgzf(slg_source *src, char *filename, off_t file_size, char *error){
+
+     unsigned char *buff = malloc(BLOCK_SCAN_WINDOW);
+     unsigned char isize[4];
+     off_t win_start = 0;
+     ssize_t win_len = 0;
+     off_t pos = 0;
+     int xlen, slen, bsize, k;
+
+     if(!buff)
+          return fail_(error, "Failed to allocate memory for frame index.");
+
+     while(pos<file_size){
+          if(pos<win_start||pos+512>win_start+win_len){
+               win_start = pos;
+               win_len = pread(src->fd, buff, BLOCK_SCAN_WINDOW, pos);
+          }
+          unsigned char *h = buff+(pos-win_start);
+          if(pos+18>win_start+win_len||h[0]!=0x1f||h[1]!=0x8b||h[2]!=8||!(h[3]&4)){
+               free(buff);
+               return fail_(error, "%s: bad gzip block at %lld", filename, (long long)pos);
+          }
+
+          xlen = rd_u16(h+10);
+          bsize = 0;
+          for(k=0;k+4<=xlen&&pos+12+k+6<=win_start+win_len;k+=4+slen){
+               slen = rd_u16(h+12+k+2);
+               if(h[12+k]=='B'&&h[12+k+1]=='C'&&slen==2)
+                    bsize = rd_u16(h+12+k+4)+1;
+          }
+          if(bsize<=18){
+               free(buff);
+               return fail_(error, "%s: gzip member at %lld has no block size, compress with bgzip", filename, (long long)pos);
+          }
+
+          if(pread(src->fd, isize, 4, pos+bsize-4)!=4){
+               free(buff);
+               return fail_(error, "%s: truncated gzip block at %lld", filename, (long long)pos);
+          }
+          /* the end of file marker is an empty block */
+          if(rd_u32(isize)&&source_add_frame(src, pos, bsize, rd_u32(isize), error)){
+               free(buff);
+               return -1;
+          }
+          pos += bsize;
+     }
+     free(buff);
+     return 0;
+}
+
+/* seekable zstd keeps a table of frame sizes in a skippable frame at the end */
+int source_index_zstd(slg_source *src, char *filename, off_t file_size, char *error){
+
+     unsigned char footer[9];
+     unsigned char *table;
+     int frames, entry_size, i;
+     off_t coffset = 0;
+
+     if(pread(src->fd, footer, 9, file_size-9)!=9)
+          return fail_(error, "%s: truncated seek table", filename);
+     frames = rd_u32(footer);
+     entry_size = (footer[4]&0x80) ? 12 : 8;
+     if(file_size<9+(off_t)frames*entry_size)
+          return fail_(error, "%s: bad seek table", filename);
+
+     table = malloc((size_t)frames*entry_size+1);
+     if(!table)
+          return fail_(error, "Failed to allocate memory for frame index.");
+     if(pread(src->fd, table, (size_t)frames*entry_size, file_size-9-(off_t)frames*entry_size)!=(ssize_t)frames*entry_size){
+          free(table);
+          return fail_(error, "%s: truncated seek table", filename);
+     }
+
+     for(i=0;i<frames;++i){
+          unsigned csize = rd_u32(table+i*entry_size);
+          unsigned usize = rd_u32(table+i*entry_size+4);
+          if(usize&&source_add_frame(src, coffset, csize, usize, error)){
+               free(table);
+               return -1;
+          }
+          coffset += csize;
+     }
+     free(table);
+     return 0;
+}
+
+int source_open(slg_source *src, char *filename, char *error){
+
+     unsigned char magic[18], footer[4];
+     struct stat fileinfo;
+
+     memset(src, 0, sizeof(slg_source));
+     src->fd = open(filename, O_RDONLY);
+     if(src->fd<0||fstat(src->fd, &fileinfo)!=0)
+          return fail_(error, "SLG File %s could not be opened for reading", filename);
+     src->size = fileinfo.st_size;
+     if(fileinfo.st_size<18||pread(src->fd, magic, 18, 0)!=18)
+          return 0;
+
+     if(magic[0]==0x1f&&magic[1]==0x8b){
+          if(!(magic[3]&4)||magic[12]!='B'||magic[13]!='C')
+               return fail_(error, "%s is gzip without blocks, recompress with bgzip", filename);
+          src->type = SOURCE_BGZF;
+          src->size = 0;
+          return source_index_bgzf(src, filename, fileinfo.st_size, error);
+     }
+
+     if(rd_u32(magic)==0xFD2FB528){
+          if(pread(src->fd, footer, 4, fileinfo.st_size-4)!=4||rd_u32(footer)!=ZSTD_SEEKABLE_MAGIC)
+               return fail_(error, "%s is zstd without a seek table, recompress as seekable zstd", filename);
+#ifndef HAVE_ZSTD
+          return fail_(error, "%s is zstd compressed, build with -DHAVE_ZSTD -lzstd to read it", filename);
+#endif
+          src->type = SOURCE_ZSTD;
+          src->size = 0;
+          return source_index_zstd(src, filename, fileinfo.st_size, error);
+     }
+
+     if(!memcmp(magic, ARCHIVE_MAGIC, 4)){
+          src->type = SOURCE_ARCHIVE;
+          src->size = 0;
+          return source_index_archive(src, filename, fileinfo.st_size, error);
+     }
+     return 0;
+}
+
+void source_close(slg_source *src){
+     if(src->frames)free(src->frames);
+     if(src->headers)free(src->headers);
+     src->frames = NULL;
+     src->headers = NULL;
+     close(src->fd);
+}
+
+/* decompress one frame into dst, which holds the whole frame */
+int frame_decompress(slg_source *src, source_frame *fr, char *dst){
+
+     char *cbuf = malloc(fr->csize);
+     int ok = 0;
+
+     if(!cbuf)
+          abort_("Failed to allocate memory for frame.");
+     if(pread(src->fd, cbuf, fr->csize, fr->coffset)==(ssize_t)fr->csize){
+          if(src->type==SOURCE_BGZF){
+               z_stream zs;
+               memset(&zs, 0, sizeof(zs));
+               if(inflateInit2(&zs, 15+16)==Z_OK){
+                    zs.next_in = (Bytef*) cbuf;
+                    zs.avail_in = fr->csize;
+                    zs.next_out = (Bytef*) dst;
+                    zs.avail_out = fr->usize;
+                    ok = inflate(&zs, Z_FINISH)==Z_STREAM_END&&zs.total_out==fr->usize;
+                    inflateEnd(&zs);
+               }
+          }
+#ifdef HAVE_ZSTD
+          if(src->type==SOURCE_ZSTD){
+               size_t n = ZSTD_decompress(dst, fr->usize, cbuf, fr->csize);
+               ok = !ZSTD_isError(n)&&n==fr->usize;
+          }
+#endif
+          /* the log header is stored as is, chunks are whole pages */
+          if(src->type==SOURCE_ARCHIVE&&!fr->uoffset){
+               memcpy(dst, cbuf, fr->usize);
+               ok = 1;
+          }else if(src->type==SOURCE_ARCHIVE)
+          {
+               uLongf n = fr->usize;
+               ok = uncompress((Bytef*) dst, &n, (Bytef*) cbuf, fr->csize)==Z_OK&&n==fr->usize;
+               if(ok)archive_undelta(dst, fr->usize/SONAR_SIZE);
+          }
+     }
+     free(cbuf);
+     return ok;
+}
+
+/* decompress every step'th frame of a read, damaged frames read as
+ * zeros and are skipped by the page scan like any other damage */
+void* source_read_frames(void *ptr_data){
+
+     source_read *rd = (source_read*) ptr_data;
+     slg_source *src = rd->src;
+     char *part = NULL;
+     int f;
+
+     for(f=rd->first;f<=rd->last;f+=rd->step){
+          source_frame *fr = &src->frames[f];
+          off_t lo = fr->uoffset>rd->offset ? fr->uoffset : rd->offset;
+          off_t hi = fr->uoffset+fr->usize;
+          if(hi>rd->offset+(off_t)rd->len)hi = rd->offset+rd->len;
+
+          if(lo==fr->uoffset&&hi==fr->uoffset+fr->usize){
+               if(!frame_decompress(src, fr, rd->buf+(lo-rd->offset))){
+                    memset(rd->buf+(lo-rd->offset), 0, hi-lo);
+                    rd->failed++;
+               }
+               continue;
+          }
+          /* frame cut by the ends of the read */
+          part = realloc(part, fr->usize);
+          if(!part)
+               abort_("Failed to allocate memory for frame.");
+          if(frame_decompress(src, fr, part)){
+               memcpy(rd->buf+(lo-rd->offset), part+(lo-fr->uoffset), hi-lo);
+          }else
+          {
+               memset(rd->buf+(lo-rd->offset), 0, hi-lo);
+               rd->failed++;
+          }
+     }
+     free(part);
+     return NULL;
+}
+
+/* frame holding log offset */
+int source_frame_at(slg_source *src, off_t offset){
+
+     int lo = 0, hi = src->frame_count-1, mid;
+
+     while(lo<hi){
+          mid = (lo+hi+1)/2;
+          if(src->frames[mid].uoffset<=offset)lo = mid;
+          else hi = mid-1;
+     }
+     return lo;
+}
+
+/* pread from the log, the frames of a compressed read are shared out
+ * over threads */
+ssize_t source_pread_parallel(slg_source *src, void *buf, size_t len, off_t offset, int threads){
+
+     source_read rd[THREADS];
+     pthread_t helpers[THREADS];
+     int started[THREADS];
+     int first, last, i, failed = 0;
+
+     if(src->type==SOURCE_PLAIN)
+          return pread(src->fd, buf, len, offset);
+
+     if(offset<0||offset>=src->size||!len)return 0;
+     if(offset+(off_t)len>src->size)len = src->size-offset;
+
+     first = source_frame_at(src, offset);
+     last = source_frame_at(src, offset+len-1);
+     if(threads>THREADS)threads = THREADS;
+     if(threads>last-first+1)threads = last-first+1;
+     if(threads<1)threads = 1;
+
+     for(i=0;i<threads;++i){
+          rd[i].src = src;
+          rd[i].buf = buf;
+          rd[i].len = len;
+          rd[i].offset = offset;
+          rd[i].first = first+i;
+          rd[i].last = last;
+          rd[i].step = threads;
+          rd[i].failed = 0;
+          started[i] = i>0&&pthread_create(&helpers[i], NULL, source_read_frames, &rd[i])==0;
+          if(i>0&&!started[i])source_read_frames(&rd[i]);
+     }
+     source_read_frames(&rd[0]);
+     for(i=0;i<threads;++i){
+          if(started[i])pthread_join(helpers[i], NULL);
+          failed += rd[i].failed;
+     }
+     if(failed)
+          fprintf(stderr, "%d damaged frames in %lld-%lld\n", failed, (long long)offset, (long long)(offset+len));
+     return len;
+}
+
+ssize_t source_pread(slg_source *src, void *buf, size_t len, off_t offset){
+     return source_pread_parallel(src, buf, len, offset, 1);
+}
+
+/* Chunked archive
+ *
+ * An archive holds the pages a scan found, back to back, so it reads as
+ * a clean log of SLG pages. Echo grams change little from one page to
+ * the next: each page is stored as its byte difference from the page
+ * before and a chunk of them is deflated together. Chunks are the frames
+ * of the source and decompress independently, the frame index and the
+ * scanned header values are kept at the end so a render takes its page
+ * scan from the columns without touching the chunks.
+ *
+ *   magic, version, pages, chunk pages, chunks      host byte order
+ *   log header                                       8 bytes
+ *   chunks
+ *   chunk offsets                                    chunks+1 long long
+ *   flags, depth limit, depth, temperature C         a column each
+ *   latitude, longitude                              double columns
+ *   source page ordinal                              int column, version 2
+ *   offset of the chunk offsets (long long), magic
+ */
+void archive_delta(char *pages, int count){
+
+     unsigned char *p = (unsigned char*) pages;
+     int i, k;
+
+     for(i=count-1;i>0;--i){
+          for(k=0;k<SONAR_SIZE;++k)
+               p[i*SONAR_SIZE+k] -= p[(i-1)*SONAR_SIZE+k];
+     }
+}
+
+void archive_undelta(char *pages, int count){
+
+     unsigned char *p = (unsigned char*) pages;
+     int i, k;
+
+     for(i=1;i<count;++i){
+          for(k=0;k<SONAR_SIZE;++k)
+               p[i*SONAR_SIZE+k] += p[(i-1)*SONAR_SIZE+k];
+     }
+}
+
+int source_index_archive(slg_source *src, char *filename, off_t file_size, char *error){
+
+     int header[4];
+     char trailer[sizeof(long long)+4];
+     long long index_offset, *coffsets;
+     char *columns;
+     int pages, chunk_pages, chunks, c, n, ordinals;
+     size_t len;
+
+     if(pread(src->fd, header, sizeof(header), 4)!=sizeof(header)||header[0]<1||header[0]>ARCHIVE_VERSION)
+          return fail_(error, "%s is not an archive of this version", filename);
+     ordinals = header[0]>=2;
+     pages = header[1];
+     chunk_pages = header[2];
+     chunks = header[3];
+     if(pages<1||chunk_pages<1||chunks!=(pages+chunk_pages-1)/chunk_pages)
+          return fail_(error, "%s: bad archive header", filename);
+
+     if(pread(src->fd, trailer, sizeof(trailer), file_size-sizeof(trailer))!=sizeof(trailer)||
+        memcmp(trailer+sizeof(long long), ARCHIVE_MAGIC, 4))
+          return fail_(error, "%s: archive index missing, the archive was cut short", filename);
+     memcpy(&index_offset, trailer, sizeof(long long));
+
+     /* chunk offsets and the header columns in one read */
+     len = sizeof(long long)*(chunks+1)+((1+ordinals)*sizeof(int)+3*sizeof(float)+2*sizeof(double))*(size_t)pages;
+     if(index_offset<0||index_offset+(off_t)len+(off_t)sizeof(trailer)!=file_size)
+          return fail_(error, "%s: bad archive index", filename);
+     columns = malloc(len);
+     src->headers = malloc(sizeof(processed_page_data)*pages);
+     if(!columns||!src->headers){
+          free(columns);
+          return fail_(error, "Failed to allocate memory for archive index.");
+     }
+     if(pread(src->fd, columns, len, index_offset)!=(ssize_t)len){
+          free(columns);
+          return fail_(error, "%s: truncated archive index", filename);
+     }
+
+     /* the log header, then a frame a chunk */
+     coffsets = (long long*) columns;
+     if(source_add_frame(src, 4+sizeof(header), FILE_HEADER_SIZE, FILE_HEADER_SIZE, error)){
+          free(columns);
+          return -1;
+     }
+     for(c=0;c<chunks;++c){
+          n = c<chunks-1 ? chunk_pages : pages-c*chunk_pages;
+          if(coffsets[c+1]<coffsets[c]||coffsets[c+1]>index_offset){
+               free(columns);
+               return fail_(error, "%s: bad archive index", filename);
+          }
+          if(source_add_frame(src, coffsets[c], coffsets[c+1]-coffsets[c], n*SONAR_SIZE, error)){
+               free(columns);
+               return -1;
+          }
+     }
+
+     int *flags = (int*) (coffsets+chunks+1);
+     float *limit = (float*) (flags+pages);
+     float *depth = limit+pages;
+     float *tempr = depth+pages;
+     double *lat = (double*) (tempr+pages);
+     double *lon = lat+pages;
+     int *ordinal = (int*) (lon+pages);
+     for(c=0;c<pages;++c){
+          processed_page_data *pd = &src->headers[c];
+          memset(pd, 0, sizeof(processed_page_data));
+          pd->ordinal = ordinals ? ordinal[c] : c;
+          pd->flags = flags[c];
+          pd->depth_limit_bottom = limit[c];
+          pd->depth_hard = depth[c];
+          pd->temprc = tempr[c];
+          pd->lat = lat[c];
+          pd->lon = lon[c];
+     }
+     src->page_count = pages;
+     free(columns);
+     return 0;
+}
+
+/* read, delta code and deflate one chunk */
+void* archive_compress_chunk(void *ptr_data){
+
+     archive_chunk *ch = (archive_chunk*) ptr_data;
+
+     if(read_section_pages(&ch->td, ch->raw, ch->count)<ch->count)
+          abort_("Error reading pages %d-%d for the archive", ch->td.page_data[0].ordinal,
+                 ch->td.page_data[ch->count-1].ordinal);
+     archive_delta(ch->raw, ch->count);
+     ch->out_len = compressBound((uLong)ch->count*SONAR_SIZE);
+     if(compress2(ch->out, (uLongf*) &ch->out_len, (Bytef*) ch->raw, (uLong)ch->count*SONAR_SIZE, ARCHIVE_LEVEL)!=Z_OK)
+          abort_("Error compressing archive chunk");
+     return NULL;
+}
+
+/* write the scanned pages to an archive, chunks are compressed on
+ * threads a round at a time and written in order. Page ordinals are
+ * stored from first_page, the source page of ordinal 0 */
+void archive_write(char *file_name, slg_source *src, block_layout *layout, char *log_header,
+                   processed_page_data *pages, int count, int first_page, int threads){
+
+     archive_chunk chunk[MAX_THREADS];
+     pthread_t helpers[MAX_THREADS];
+     int started[MAX_THREADS];
+     int chunks = (count+ARCHIVE_CHUNK_PAGES-1)/ARCHIVE_CHUNK_PAGES;
+     int header[4] = {ARCHIVE_VERSION, count, ARCHIVE_CHUNK_PAGES, chunks};
+     char zero_header[FILE_HEADER_SIZE] = {0};
+     long long *coffsets, pos, index_offset;
+     FILE *fp;
+     int c, i, n, ordinal;
+     size_t written;
+
+     coffsets = malloc(sizeof(long long)*(chunks+1));
+     if(!coffsets)
+          abort_("Failed to allocate memory for archive index.");
+     if(threads>MAX_THREADS)threads = MAX_THREADS;
+     for(i=0;i<threads;++i){
+          memset(&chunk[i], 0, sizeof(archive_chunk));
+          chunk[i].td.source = src;
+          chunk[i].td.layout = layout;
+          chunk[i].raw = malloc((size_t)ARCHIVE_CHUNK_PAGES*SONAR_SIZE);
+          chunk[i].out = malloc(compressBound((uLong)ARCHIVE_CHUNK_PAGES*SONAR_SIZE));
+          if(!chunk[i].raw||!chunk[i].out)
+               abort_("Failed to allocate memory for archive chunks.");
+     }
+
+     fp = fopen(file_name, "wb");
+     if(!fp)
+          abort_("Archive %s could not be opened for writing", file_name);
+
+     /* SL2/SL3 blocks are archived as the SLG pages they render as */
+     if(fwrite(ARCHIVE_MAGIC, 4, 1, fp)!=1||fwrite(header, sizeof(header), 1, fp)!=1||
+        fwrite(layout ? zero_header : log_header, FILE_HEADER_SIZE, 1, fp)!=1)
+          abort_("Error writing archive %s", file_name);
+     pos = 4+sizeof(header)+FILE_HEADER_SIZE;
+
+     for(c=0;c<chunks;c+=threads){
+          n = chunks-c<threads ? chunks-c : threads;
+          for(i=0;i<n;++i){
+               chunk[i].td.page_data = pages+(size_t)(c+i)*ARCHIVE_CHUNK_PAGES;
+               chunk[i].count = c+i<chunks-1 ? ARCHIVE_CHUNK_PAGES : count-(c+i)*ARCHIVE_CHUNK_PAGES;
+               started[i] = i>0&&pthread_create(&helpers[i], NULL, archive_compress_chunk, &chunk[i])==0;
+               if(i>0&&!started[i])archive_compress_chunk(&chunk[i]);
+          }
+          archive_compress_chunk(&chunk[0]);
+          for(i=0;i<n;++i){
+               if(started[i])pthread_join(helpers[i], NULL);
+               coffsets[c+i] = pos;
+               if(fwrite(chunk[i].out, 1, chunk[i].out_len, fp)!=chunk[i].out_len)
+                    abort_("Error writing archive %s", file_name);
+               pos += chunk[i].out_len;
+          }
+     }
+     coffsets[chunks] = pos;
+     index_offset = pos;
+
+     /* chunk offsets, then a column a header value */
+     if(fwrite(coffsets, sizeof(long long), chunks+1, fp)!=chunks+1)
+          abort_("Error writing archive %s", file_name);
+     written = 0;
+     for(i=0;i<count;++i)written += fwrite(&pages[i].flags, sizeof(int), 1, fp);
+     for(i=0;i<count;++i)written += fwrite(&pages[i].depth_limit_bottom, sizeof(float), 1, fp);
+     for(i=0;i<count;++i)written += fwrite(&pages[i].depth_hard, sizeof(float), 1, fp);
+     for(i=0;i<count;++i)written += fwrite(&pages[i].temprc, sizeof(float), 1, fp);
+     for(i=0;i<count;++i)written += fwrite(&pages[i].lat, sizeof(double), 1, fp);
+     for(i=0;i<count;++i)written += fwrite(&pages[i].lon, sizeof(double), 1, fp);
+     for(i=0;i<count;++i){
+          ordinal = pages[i].ordinal+first_page;
+          written += fwrite(&ordinal, sizeof(int), 1, fp);
+     }
+     if(written!=(size_t)count*7)
+          abort_("Error writing archive %s", file_name);
+     if(fwrite(&index_offset, sizeof(long long), 1, fp)!=1||fwrite(ARCHIVE_MAGIC, 4, 1, fp)!=1||fclose(fp))
+          abort_("Error writing archive %s", file_name);
+
+     for(i=0;i<threads;++i){
+          free(chunk[i].raw);
+          free(chunk[i].out);
+     }
+     free(coffsets);
+}
+
+/* SLG page scan
+ *
+ * SLG pages are fixed size and follow each other, but a log cut short by
+ * a card pull or written over in places has truncated or garbage ranges.
+ * Page headers are checked for plausible values as they are scanned. When
+ * the page at the expected offset fails, the scan window is searched for
+ * the next offset where a page with known flags is followed by another
+ * valid page a page size on.
+ */
+int page_valid(page_data *page){
+
+     int flags = (page->flags)>>16;
+
+     if(!isfinite(page->depth_limit_bottom)||page->depth_limit_bottom<=0||
+        page->depth_limit_bottom>PAGE_MAX_DEPTH)
+          return 0;
+     if(!isfinite(page->depth_hard)||page->depth_hard<0||page->depth_hard>PAGE_MAX_DEPTH)
+          return 0;
+     if(flags==0x2c11||flags==0x6d14){
+          if(!isfinite(page->tempr)||page->tempr<PAGE_MIN_TEMPR||page->tempr>PAGE_MAX_TEMPR)
+               return 0;
+     }
+     return flags!=0;
+}
+
+/* bytes at pos from the scan window, NULL past the end of the file */
+char* scan_bytes(page_scan *ps, off_t pos, size_t len){
+
+     ssize_t n;
+
+     if(pos<0||pos+(off_t)len>ps->file_size)return NULL;
+     if(pos>=ps->start&&pos+len<=ps->start+ps->len)
+          return ps->data+(pos-ps->start);
+
+     if(!ps->data){
+          ps->data = malloc(BLOCK_SCAN_WINDOW);
+          if(!ps->data)
+               abort_("Failed to allocate memory for page scan.");
+     }
+     /* compressed windows decompress their frames in parallel */
+     n = source_pread_parallel(ps->src, ps->data, BLOCK_SCAN_WINDOW, pos, THREADS);
+     ps->start = pos;
+     ps->len = n>0 ? n : 0;
+     return len<=ps->len ? ps->data : NULL;
+}
+
+int scan_flags_known(page_scan *ps, int flags){
+
+     int k;
+
+     if(flags==ps->last_flags)return 1;
+     for(k=0;k<sizeof(slg_page_flags)/sizeof(int);++k){
+          if(flags==slg_page_flags[k])return 1;
+     }
+     return 0;
+}
+
+/* valid page at pos, or the first one found searching from from.
+ * Returns its offset with the header in page, -1 when none is left */
+off_t scan_page(page_scan *ps, off_t pos, off_t from, page_data *page){
+
+     page_data next;
+     char *p;
+     off_t o;
+
+     p = scan_bytes(ps, pos, SONAR_SIZE);
+     if(p){
+          memcpy(page, p, sizeof(page_data));
+          if(page_valid(page)){
+               ps->last_flags = (page->flags)>>16;
+               return pos;
+          }
+     }
+
+     /* resync, a candidate needs known flags and a valid page after it
+      * unless it is the last page of the file */
+     ps->resyncs++;
+     for(o=from;o+SONAR_SIZE<=ps->file_size;++o){
+          p = scan_bytes(ps, o, SONAR_SIZE+sizeof(page_data));
+          if(!p)p = scan_bytes(ps, o, SONAR_SIZE);
+          if(!p)break;
+          if(!scan_flags_known(ps, rd_u16((unsigned char*)p+2)))continue;
+          memcpy(page, p, sizeof(page_data));
+          if(!page_valid(page))continue;
+          if(o+SONAR_SIZE+(off_t)sizeof(page_data)<=ps->file_size){
+               memcpy(&next, p+SONAR_SIZE, sizeof(page_data));
+               if(!page_valid(&next))continue;
+          }
+          ps->skipped += o>pos ? o-pos : 0;
+          ps->last_flags = (page->flags)>>16;
+          return o;
+     }
+     ps->skipped += ps->file_size>pos ? ps->file_size-pos : 0;
+     return -1;
+}
+
+/* streamed SLG pages
+ *
+ * A pipe can't be seeked, pages are taken from a read ahead buffer in
+ * order. Damaged ranges resync as in the file scan, on the first offset
+ * with known flags and a valid page after it.
+ */
+
+/* at least need bytes from pos in the buffer, fewer at the end of the
+ * stream. Returns the bytes available */
+size_t stream_fill(stream_input *si, size_t need){
+
+     ssize_t n;
+
+     if(si->len-si->pos>=need||si->eof)
+          return si->len-si->pos;
+
+     /* move what is left to the front, with the last page while a short
+      * page can still be found inside it. A resync past it drops it, so
+      * pos+need always fits and a read never gets zero space */
+     if(si->pos+need>STREAM_BUFFER){
+          size_t keep = si->pos;
+          if(si->prev>=0&&si->pos-si->prev<=SONAR_SIZE)
+               keep = si->prev;
+          else
+               si->prev = -1;
+          memmove(si->data, si->data+keep, si->len-keep);
+          si->offset += keep;
+          si->len -= keep;
+          si->pos -= keep;
+          if(si->prev>=0)si->prev = 0;
+     }
+     while(si->len-si->pos<need){
+          n = read(si->fd, si->data+si->len, STREAM_BUFFER-si->len);
+          if(n<0&&errno==EINTR)continue;
+          if(n<=0){
+               si->eof = 1;
+               break;
+          }
+          si->len += n;
+     }
+     return si->len-si->pos;
+}
+
+/* copy the next valid page to dest with its header in page. Returns its
+ * stream offset, -1 at the end of the stream */
+off_t stream_next_page(stream_input *si, void *dest, page_data *page, int ordinal){
+
+     page_data next;
+     size_t avail;
+     char *p;
+     off_t pos = si->offset+si->pos;
+     off_t found;
+
+     avail = stream_fill(si, SONAR_SIZE);
+     if(avail<SONAR_SIZE){
+          if(avail)
+               fprintf(stderr, "Skipped %lld-%lld, no valid pages to end of stream\n",
+                       (long long)pos, (long long)(pos+avail));
+          si->scan.skipped += avail;
+          return -1;
+     }
+     memcpy(page, si->data+si->pos, sizeof(page_data));
+
+     /* resync, a candidate needs known flags and a valid page after it
+      * unless it is the last page of the stream */
+     if(!page_valid(page)){
+          si->scan.resyncs++;
+          if(si->prev>=0)si->pos = si->prev;
+          for(;;){
+               si->pos++;
+               avail = stream_fill(si, SONAR_SIZE+sizeof(page_data));
+               if(avail<SONAR_SIZE){
+                    fprintf(stderr, "Skipped %lld-%lld, no valid pages to end of stream\n",
+                            (long long)pos, (long long)(si->offset+si->len));
+                    si->scan.skipped += si->offset+si->len-pos;
+                    si->pos = si->len;
+                    return -1;
+               }
+               p = si->data+si->pos;
+               if(!scan_flags_known(&si->scan, rd_u16((unsigned char*)p+2)))continue;
+               memcpy(page, p, sizeof(page_data));
+               if(!page_valid(page))continue;
+               if(avail>=SONAR_SIZE+sizeof(page_data)){
+                    memcpy(&next, p+SONAR_SIZE, sizeof(page_data));
+                    if(!page_valid(&next))continue;
+               }
+               break;
+          }
+          found = si->offset+si->pos;
+          if(found>pos){
+               fprintf(stderr, "Skipped %lld-%lld, resync at page %d\n",
+                       (long long)pos, (long long)found, ordinal);
+               si->scan.skipped += found-pos;
+          }
+          if(found<pos)
+               fprintf(stderr, "Page %d at %lld short by %lld bytes\n", ordinal-1,
+                       (long long)(si->offset+si->prev), (long long)(pos-found));
+          pos = found;
+     }
+
+     memcpy(dest, si->data+si->pos, SONAR_SIZE);
+     si->scan.last_flags = (page->flags)>>16;
+     si->prev = si->pos;
+     si->pos += SONAR_SIZE;
+     return pos;
+}
+
+/* SL2/SL3 block index
+ *
+ * SL2/SL3 logs are a chain of variable-length blocks. Each block header
+ * carries its own file offset, its size and the channel it belongs to.
+ * The file is split into regions and each region is scanned by its own
+ * thread: it resyncs on the first header whose offset field matches its
+ * position and walks the chain from there. Regions are stitched together
+ * afterwards, re-walking any gap where a region resynced on a false header.
+ */
+block_layout* detect_format(unsigned char *header){
+
+     int format = header[0]|(header[1]<<8);
+     int i;
+
+     for(i=0;i<sizeof(block_layouts)/sizeof(block_layout);++i){
+          if(block_layouts[i].format==format)
+               return &block_layouts[i];
+     }
+     /* classic SLG */
+     return NULL;
+}
+
+unsigned int rd_u16(unsigned char *p){
+     return p[0]|(p[1]<<8);
+}
+
+unsigned int rd_u32(unsigned char *p){
+     return p[0]|(p[1]<<8)|(p[2]<<16)|((unsigned int)p[3]<<24);
+}
+
+float rd_f32(unsigned char *p){
+     float f;
+     unsigned int u = rd_u32(p);
+     memcpy(&f, &u, sizeof(f));
+     return f;
+}
+
+/* validate the block header at file position pos */
+int parse_block(block_layout *bl, unsigned char *hdr, off_t pos, off_t file_size, sonar_block *blk){
+
+     int block_size = rd_u16(hdr+bl->off_block_size);
+     int packet_size = rd_u16(hdr+bl->off_packet_size);
+     int channel = rd_u16(hdr+bl->off_channel);
+
+     if(rd_u32(hdr)!=(unsigned int)pos)return 0;
+     if(block_size<bl->header_size||pos+block_size>file_size)return 0;
+     if(packet_size>block_size-bl->header_size)return 0;
+     if(channel>=MAX_CHANNELS)return 0;
+
+     if(blk){
+          blk->offset = pos;
+          blk->block_size = block_size;
+          blk->packet_size = packet_size;
+          blk->channel = channel;
+          blk->lower_limit = rd_f32(hdr+bl->off_lower_limit);
+          blk->depth = rd_f32(hdr+bl->off_depth);
+          blk->tempr = rd_f32(hdr+bl->off_tempr);
+          blk->lon = (int)rd_u32(hdr+bl->off_lon);
+          blk->lat = (int)rd_u32(hdr+bl->off_lat);
+     }
+     return 1;
+}
+
+int index_add(block_index *index, sonar_block *blk){
+
+     if(index->count==index->size){
+          int size = index->size ? index->size*2 : 4096;
+          sonar_block *blocks = realloc(index->blocks, sizeof(sonar_block)*size);
+          if(!blocks)
+               abort_("Failed to allocate memory for block index.");
+          index->blocks = blocks;
+          index->size = size;
+     }
+     index->blocks[index->count++] = *blk;
+     return index->count;
+}
+
+/* walk the block chain from start until a block begins at or past stop,
+ * returns the offset the walk ended at */
+off_t walk_blocks(slg_source *src, block_layout *bl, off_t start, off_t stop, off_t file_size, block_index *index){
+
+     unsigned char *buff = malloc(BLOCK_SCAN_WINDOW);
+     off_t win_start = 0;
+     int win_len = 0;
+     off_t pos = start;
+     sonar_block blk;
+
+     if(!buff)
+          abort_("Failed to allocate memory for block scan.");
+
+     while(pos<stop&&pos+bl->header_size<=file_size){
+          if(pos<win_start||pos+bl->header_size>win_start+win_len){
+               win_start = pos;
+               win_len = source_pread(src, buff, BLOCK_SCAN_WINDOW, pos);
+               if(win_len<bl->header_size)break;
+          }
+          if(!parse_block(bl, buff+(pos-win_start), pos, file_size, &blk))break;
+          index_add(index, &blk);
+          pos += blk.block_size;
+     }
+
+     free(buff);
+     return pos;
+}
+
+/* find the first valid block at or after start, confirmed by its successor */
+off_t find_block(slg_source *src, block_layout *bl, off_t start, off_t stop, off_t file_size){
+
+     unsigned char *buff = malloc(BLOCK_SCAN_WINDOW);
+     unsigned char next[256];
+     off_t pos = start;
+     off_t found = -1;
+     sonar_block blk;
+     int win_len, p;
+
+     if(!buff)
+          abort_("Failed to allocate memory for block scan.");
+
+     while(found<0&&pos<stop){
+          win_len = source_pread(src, buff, BLOCK_SCAN_WINDOW, pos);
+          if(win_len<bl->header_size)break;
+
+          for(p=0;p+bl->header_size<=win_len&&pos+p<stop;++p){
+               if(rd_u32(buff+p)!=(unsigned int)(pos+p))continue;
+               if(!parse_block(bl, buff+p, pos+p, file_size, &blk))continue;
+               /* last block in file needs no confirmation */
+               if(blk.offset+blk.block_size+bl->header_size>file_size){
+                    found = blk.offset;
+                    break;
+               }
+               if(source_pread(src, next, bl->header_size, blk.offset+blk.block_size)==bl->header_size&&
+                    parse_block(bl, next, blk.offset+blk.block_size, file_size, NULL)){
+                    found = blk.offset;
+                    break;
+               }
+          }
+          /* overlap windows by one header */
+          pos += win_len-bl->header_size+1;
+     }
+
+     free(buff);
+     return found;
+}
+
+void* block_scan_thread(void* ptr_data){
+
+     block_scan_region *region = (block_scan_region*) ptr_data;
+     off_t first = find_block(region->src, region->layout, region->start, region->stop, region->file_size);
+
+     region->end = region->start;
+     if(first>=0)
+          region->end = walk_blocks(region->src, region->layout, first, region->stop, region->file_size, &region->index);
+     return NULL;
+}
+
+int build_block_index(slg_source *src, block_layout *layout, int regions, block_index *index){
+
+     block_scan_region region[THREADS];
+     pthread_t threads[THREADS];
+     int started[THREADS];
+     off_t file_size = src->size;
+     off_t region_size, expect;
+     int i, j;
+
+     if(regions>THREADS)regions = THREADS;
+
+     /* small files are not worth splitting */
+     region_size = (file_size-FILE_HEADER_SIZE)/regions;
+     if(region_size<BLOCK_SCAN_WINDOW){
+          regions = 1;
+          region_size = file_size-FILE_HEADER_SIZE;
+     }
+
+     for(i=0;i<regions;++i){
+          memset(&region[i], 0, sizeof(block_scan_region));
+          region[i].src = src;
+          region[i].layout = layout;
+          region[i].file_size = file_size;
+          region[i].start = FILE_HEADER_SIZE+region_size*i;
+          region[i].stop = (i==regions-1) ? file_size : region[i].start+region_size;
+          started[i] = pthread_create(&threads[i], NULL, block_scan_thread, &region[i])==0;
+          if(!started[i])block_scan_thread(&region[i]);
+     }
+     for(i=0;i<regions;++i){
+          if(started[i])pthread_join(threads[i], NULL);
+     }
+
+     /* stitch regions, the first block sits right after the file header */
+     index->count = 0;
+     expect = FILE_HEADER_SIZE;
+     for(i=0;i<regions;++i){
+          block_index *ri = &region[i].index;
+
+          /* skip false resyncs inside the previous region's last block */
+          for(j=0;j<ri->count&&ri->blocks[j].offset<expect;++j);
+
+          if(j<ri->count&&ri->blocks[j].offset>expect){
+               /* region resynced past the expected block, walk the gap */
+               expect = walk_blocks(src, layout, expect, ri->blocks[j].offset, file_size, index);
+               for(;j<ri->count&&ri->blocks[j].offset<expect;++j);
+          }
+          if(j<ri->count){
+               for(;j<ri->count;++j)index_add(index, &ri->blocks[j]);
+               expect = region[i].end;
+          }else if(expect<region[i].stop)
+          {
+               /* nothing usable from this region, walk it */
+               expect = walk_blocks(src, layout, expect, region[i].stop, file_size, index);
+          }
+          free(ri->blocks);
+     }
+
+     return index->count;
+}
+
+/* read count pages of a section into pSonarInput as raw SLG pages */
+int read_section_pages(thread_section_data *td, void *pSonarInput, int count){
+
+     processed_page_data *pages = td->page_data;
+     raw_sonar_page *pPageRaw = (raw_sonar_page*) pSonarInput;
+     block_layout *bl = td->layout;
+     unsigned char *span, *blk;
+     off_t span_start, span_len;
+     int i, j, echo_len, packet_size;
+
+     if(!bl){
+          /* classic SLG pages follow each other apart from ranges skipped
+           * by the scan, each run of pages is one read */
+          for(i=0;i<count;i=j){
+               for(j=i+1;j<count&&pages[j].offset==pages[j-1].offset+SONAR_SIZE;++j);
+               span_len = source_pread(td->source, &pPageRaw[i], (size_t)SONAR_SIZE*(j-i), pages[i].offset);
+               if(span_len<(off_t)SONAR_SIZE*(j-i))
+                    return i+(span_len<0 ? 0 : span_len/SONAR_SIZE);
+          }
+          return count;
+     }
+
+     /* channel blocks are interleaved with the other channels, read the
+      * covering span once and rebuild each block as an SLG page */
+     span_start = pages[0].offset;
+     span_len = pages[count-1].offset+pages[count-1].size-span_start;
+     span = malloc(span_len);
+     if(!span)
+          abort_("Failed to allocate memory for block data.");
+     if(source_pread(td->source, span, span_len, span_start)!=span_len){
+          free(span);
+          return 0;
+     }
+
+     echo_len = sizeof(raw_sonar_page)-offsetof(sonar_page, echo_data);
+     if(echo_len>ECHO_GRAM_SIZE)echo_len = ECHO_GRAM_SIZE;
+
+     for(i=0;i<count;++i){
+          page_data *pPage = (page_data*) &pPageRaw[i];
+          char *pEchoData = (char*) &pPageRaw[i] + offsetof(sonar_page, echo_data);
+
+          blk = span+(pages[i].offset-span_start);
+          packet_size = pages[i].size-bl->header_size;
+
+          memset(&pPageRaw[i], 0, sizeof(raw_sonar_page));
+          pPage->flags = pages[i].flags<<16;
+          pPage->depth_limit_bottom = pages[i].depth_limit_bottom;
+          pPage->depth_hard = pages[i].depth_hard;
+          pPage->tempr = pages[i].temprc;
+
+          /* stretch the channel samples over the echogram */
+          if(packet_size>0){
+               for(j=0;j<echo_len;++j)
+                    pEchoData[j] = blk[bl->header_size+(int)((long long)j*packet_size/ECHO_GRAM_SIZE)];
+          }
+     }
+
+     free(span);
+     return count;
+}
+
+/* io_uring I/O
+ *
+ * Each worker slot owns a ring. Section reads are queued in chunks so
+ * the rasterizer can start on the first pages while the rest are still
+ * in flight, and the encoded image is written asynchronously while the
+ * slot moves on to its next section. When io_uring is not available the
+ * ring stays closed and the blocking path is used.
+ */
+int ring_init(io_ring *ring, unsigned entries){
+
+     memset(ring, 0, sizeof(io_ring));
+     ring->fd = -1;
+
+#ifdef HAVE_IO_URING
+     struct io_uring_params params;
+     int fd;
+
+     memset(&params, 0, sizeof(params));
+     fd = syscall(__NR_io_uring_setup, entries, &params);
+     if(fd<0)return 0;
+
+     ring->sq_size = params.sq_off.array+params.sq_entries*sizeof(unsigned);
+     ring->cq_size = params.cq_off.cqes+params.cq_entries*sizeof(struct io_uring_cqe);
+     if(params.features&IORING_FEAT_SINGLE_MMAP){
+          if(ring->cq_size>ring->sq_size)ring->sq_size = ring->cq_size;
+          ring->cq_size = ring->sq_size;
+     }
+
+     ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+     if(ring->sq_ptr==MAP_FAILED){
+          close(fd);
+          return 0;
+     }
+     if(params.features&IORING_FEAT_SINGLE_MMAP)
+          ring->cq_ptr = ring->sq_ptr;
+     else
+          ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+     ring->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+     ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+     if(ring->cq_ptr==MAP_FAILED||ring->sqes==MAP_FAILED){
+          if(ring->cq_ptr!=MAP_FAILED&&ring->cq_ptr!=ring->sq_ptr)munmap(ring->cq_ptr, ring->cq_size);
+          if(ring->sqes!=MAP_FAILED)munmap(ring->sqes, ring->sqes_size);
+          munmap(ring->sq_ptr, ring->sq_size);
+          close(fd);
+          return 0;
+     }
+
+     ring->sq_head = (unsigned*)((char*)ring->sq_ptr+params.sq_off.head);
+     ring->sq_tail = (unsigned*)((char*)ring->sq_ptr+params.sq_off.tail);
+     ring->sq_mask = (unsigned*)((char*)ring->sq_ptr+params.sq_off.ring_mask);
+     ring->sq_array = (unsigned*)((char*)ring->sq_ptr+params.sq_off.array);
+     ring->cq_head = (unsigned*)((char*)ring->cq_ptr+params.cq_off.head);
+     ring->cq_tail = (unsigned*)((char*)ring->cq_ptr+params.cq_off.tail);
+     ring->cq_mask = (unsigned*)((char*)ring->cq_ptr+params.cq_off.ring_mask);
+     ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ptr+params.cq_off.cqes);
+     ring->entries = params.sq_entries;
+     ring->fd = fd;
+     return 1;
+#else
+     return 0;
+#endif
+}
+
+void ring_exit(io_ring *ring){
+     if(ring->fd<0)return;
+     if(ring->cq_ptr!=ring->sq_ptr)munmap(ring->cq_ptr, ring->cq_size);
+     munmap(ring->sq_ptr, ring->sq_size);
+#ifdef HAVE_IO_URING
+     munmap(ring->sqes, ring->sqes_size);
+#endif
+     close(ring->fd);
+     ring->fd = -1;
+}
+
+/* queue a read or write, returns 0 when the ring is full */
+int ring_queue(io_ring *ring, int write, int fd, void *buf, unsigned len, off_t offset, unsigned long long tag){
+#ifdef HAVE_IO_URING
+     unsigned tail = *ring->sq_tail;
+     unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+     unsigned index;
+     struct io_uring_sqe *sqe;
+
+     if(tail-head>=ring->entries)return 0;
+
+     index = tail&*ring->sq_mask;
+     sqe = &ring->sqes[index];
+     memset(sqe, 0, sizeof(struct io_uring_sqe));
+     sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+     sqe->fd = fd;
+     sqe->addr = (unsigned long) buf;
+     sqe->len = len;
+     sqe->off = offset;
+     sqe->user_data = tag;
+     ring->sq_array[index] = index;
+     __atomic_store_n(ring->sq_tail, tail+1, __ATOMIC_RELEASE);
+     ring->pending++;
+     return 1;
+#else
+     return 0;
+#endif
+}
+
+/* submit queued requests, optionally waiting for a completion */
+int ring_submit(io_ring *ring, int wait){
+#ifdef HAVE_IO_URING
+     int ret;
+
+     do{
+          ret = syscall(__NR_io_uring_enter, ring->fd, ring->pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+     }while(ret<0&&errno==EINTR);
+
+     if(ret>0){
+          ring->pending -= ret;
+          ring->inflight += ret;
+     }
+     return ret;
+#else
+     return -1;
+#endif
+}
+
+/* take one completion, waiting for it when blocking */
+int ring_reap(io_ring *ring, unsigned long long *tag, int *res){
+#ifdef HAVE_IO_URING
+     unsigned head, tail;
+     struct io_uring_cqe *cqe;
+
+     for(;;){
+          head = *ring->cq_head;
+          tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+          if(head!=tail)break;
+          if(!ring->inflight&&!ring->pending)return 0;
+          if(ring_submit(ring, 1)<0&&errno!=EBUSY)return 0;
+     }
+
+     cqe = &ring->cqes[head&*ring->cq_mask];
+     *tag = cqe->user_data;
+     *res = cqe->res;
+     __atomic_store_n(ring->cq_head, head+1, __ATOMIC_RELEASE);
+     ring->inflight--;
+     return 1;
+#else
+     return 0;
+#endif
+}
+
+/* finish the image write in flight */
+void io_write_done(worker_io *io, int res){
+
+     /* short or failed writes are finished in the blocking path */
+     if(res<0)res = 0;
+     if((size_t)res<io->out.size){
+          if(pwrite(io->write_fd, io->out.data+res, io->out.size-res, res)!=(ssize_t)(io->out.size-res))
+               abort_("[write_png_async] Error writing image");
+     }
+     /* archival runs keep finished images out of the page cache */
+     if(io->direct)posix_fadvise(io->write_fd, 0, 0, POSIX_FADV_DONTNEED);
+     close(io->write_fd);
+     io->write_fd = -1;
+}
+
+/* take completions until tag has been reaped, reads of sections carry their
+ * chunk number and the write carries IO_TAG_WRITE */
+int io_complete(worker_io *io, section_reader *rd){
+
+     unsigned long long tag;
+     int res;
+     size_t chunk_off, chunk_len;
+
+     if(!ring_reap(&io->ring, &tag, &res))return 0;
+
+     if(tag&IO_TAG_WRITE){
+          io_write_done(io, res);
+          return 1;
+     }
+     if(!rd)return 1;
+
+     chunk_off = tag*IO_CHUNK_SIZE;
+     chunk_len = rd->total-chunk_off;
+     if(chunk_len>IO_CHUNK_SIZE)chunk_len = IO_CHUNK_SIZE;
+
+     /* finish short or failed chunk reads with a blocking read, buffered
+      * as the rest of a short O_DIRECT read is not block aligned */
+     if(res<0)res = 0;
+     if((size_t)res<chunk_len){
+          ssize_t n = pread(rd->buffered_fd, rd->buf+chunk_off+res, chunk_len-res, rd->offset+chunk_off+res);
+          if(n<0)n = 0;
+          res += n;
+          /* end of file, nothing past this chunk is coming */
+          if((size_t)res<chunk_len)rd->total = chunk_off+res;
+     }
+     rd->done[tag] = 1;
+     return 1;
+}
+
+void io_drain_writes(worker_io *io){
+     while(io->write_fd>=0){
+          if(!io_complete(io, NULL)){
+               io_write_done(io, 0);
+          }
+     }
+}
+
+/* queue section chunks up to the queue depth */
+void reader_queue(section_reader *rd){
+
+     int queued = 0;
+     size_t len;
+
+     while(rd->queued<rd->total&&rd->queued-rd->ready<(size_t)IO_QUEUE_DEPTH*IO_CHUNK_SIZE){
+          len = rd->total-rd->queued;
+          if(len>IO_CHUNK_SIZE)len = IO_CHUNK_SIZE;
+          /* O_DIRECT needs whole blocks */
+          if(rd->direct)len = (len+IO_ALIGN-1)&~(size_t)(IO_ALIGN-1);
+          if(!ring_queue(&rd->io->ring, 0, rd->fd, rd->buf+rd->queued, len, rd->offset+rd->queued, rd->queued/IO_CHUNK_SIZE))break;
+          rd->queued += IO_CHUNK_SIZE;
+          queued++;
+     }
+     if(queued)ring_submit(&rd->io->ring, 0);
+}
+
+/* start reading a section into buf, the pages start at rd->pages */
+int reader_start(section_reader *rd, thread_section_data *td, void *buf, int count){
+
+     size_t lead = 0;
+     /* pages after a skipped range are gathered run by run */
+     int contiguous = td->page_data[count-1].offset-td->page_data[0].offset==(off_t)SONAR_SIZE*(count-1);
+
+     memset(rd, 0, sizeof(section_reader));
+     rd->io = td->io;
+     rd->fd = td->slgfd;
+     rd->buffered_fd = td->slgfd;
+     rd->buf = buf;
+     rd->pages = buf;
+
+     /* streamed pages were read into the arena before the launch */
+     if(td->streamed){
+          rd->total = (size_t)SONAR_SIZE*count;
+          rd->ready = rd->total;
+          return 0;
+     }
+
+     if(td->layout||!contiguous||td->source->type!=SOURCE_PLAIN||!td->io||td->io->ring.fd<0){
+          /* blocking read of the whole section */
+          if(!td->layout&&contiguous&&td->directfd>=0){
+               lead = td->page_data[0].offset&(IO_ALIGN-1);
+               rd->total = (lead+(size_t)SONAR_SIZE*count+IO_ALIGN-1)&~(size_t)(IO_ALIGN-1);
+               rd->total = pread(td->directfd, buf, rd->total, td->page_data[0].offset-lead);
+               rd->pages = rd->buf+lead;
+               rd->total = (ssize_t)rd->total<(ssize_t)lead ? 0 : rd->total-lead;
+          }
+          /* without O_DIRECT, or buffered when the O_DIRECT read failed */
+          if(!rd->total){
+               rd->pages = buf;
+               rd->total = (size_t)read_section_pages(td, buf, count)*SONAR_SIZE;
+          }
+          rd->ready = rd->total;
+          rd->buf = rd->pages;
+          return 0;
+     }
+
+     /* O_DIRECT reads start on a block boundary ahead of the first page */
+     if(td->directfd>=0){
+          rd->fd = td->directfd;
+          rd->direct = 1;
+          lead = td->page_data[0].offset&(IO_ALIGN-1);
+     }
+     rd->offset = td->page_data[0].offset-lead;
+     rd->pages = rd->buf+lead;
+     rd->total = lead+(size_t)SONAR_SIZE*count;
+     rd->chunks = (rd->total+IO_CHUNK_SIZE-1)/IO_CHUNK_SIZE;
+     rd->done = calloc(rd->chunks, 1);
+     if(!rd->done)
+          abort_("Failed to allocate memory for section reader.");
+
+     reader_queue(rd);
+     return 1;
+}
+
+/* wait until the section is read up to upto bytes past the first page,
+ * returns the bytes available from the first page */
+size_t reader_wait(section_reader *rd, size_t upto){
+
+     size_t lead = rd->pages-rd->buf;
+
+     upto += lead;
+     if(upto>rd->total)upto = rd->total;
+
+     while(rd->ready<upto){
+          int chunk = rd->ready/IO_CHUNK_SIZE;
+          if(rd->queued<=rd->ready)reader_queue(rd);
+          if(rd->done[chunk]){
+               rd->ready += IO_CHUNK_SIZE;
+               if(rd->ready>rd->total)rd->ready = rd->total;
+               reader_queue(rd);
+               continue;
+          }
+          if(!io_complete(rd->io, rd)){
+               /* lost the ring, read the rest in the blocking path */
+               ssize_t n = pread(rd->buffered_fd, rd->buf+rd->ready, rd->total-rd->ready, rd->offset+rd->ready);
+               rd->total = rd->ready+(n>0 ? n : 0);
+               rd->ready = rd->total;
+          }
+          if(upto>rd->total)upto = rd->total;
+     }
+     return rd->ready<lead ? 0 : rd->ready-lead;
+}
+
+/* reap what is still in flight so the buffer can be reused */
+void reader_finish(section_reader *rd){
+
+     if(rd->done){
+          while(rd->queued>rd->ready){
+               int chunk = rd->ready/IO_CHUNK_SIZE;
+               if(!rd->done[chunk]&&!io_complete(rd->io, rd))break;
+               if(rd->done[chunk])rd->ready += IO_CHUNK_SIZE;
+          }
+          free(rd->done);
+     }
+     rd->done = NULL;
+}
+
+/* encode into the slot's buffer and write it while the slot moves on */
+void write_png_async(worker_io *io, char* file_name, img_data_info img_data){
+
+     /* the previous image still owns the buffer */
+     io_drain_writes(io);
+
+     io->out.size = 0;
+     write_png(NULL, &io->out, img_data);
+
+     io->write_fd = open(file_name, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+     if(io->write_fd<0)
+          abort_("[write_png_file] File %s could not be opened for writing", file_name);
+
+     if(!ring_queue(&io->ring, 1, io->write_fd, io->out.data, io->out.size, 0, IO_TAG_WRITE)||ring_submit(&io->ring, 0)<0)
+          io_write_done(io, 0);
+}